@@ -17,6 +17,10 @@
 #include <cinttypes>
 #include <math.h>
 #include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
 
 #ifdef _WIN32
   #include "gmpwin.h"
@@ -35,7 +39,6 @@
 #include "iterate.h"
 #include "mulsmall.h"
 #include "mullarge.h"
-#include "reduce.h"
 #include "find.h"
 #include "common.h"
 
@@ -49,6 +52,17 @@
 
 #define ACUBUFFER 100
 #define PRPSIZE 12446226
+#define MAXBATCH 64			// max test primes per mulsmall launch
+#define ADAPTSEGS 32			// segments between segment size adjustments
+#define MINRANGE 1000000		// smallest segment size
+#define PROFILEPASSES 3			// max prp kernel benchmarks to find its range
+#define GRPBUFFER 33554432		// max bytes used for group totals of a batch
+#define MAXRANGE 257698007040		// largest segment, 60*(2^32-512) so the getsegprps global size rounded up to 256 fits a uint
+#define OFFSETRANGE 8589934080		// largest segment with prps stored as uint offsets, (p - low) / 2 < 2^32 with the wheel offset
+#define PERSISTGROUPS 8			// persistent mullarge workgroups per compute unit
+#define RINGSLOTS 4096			// max mullarge group total slots
+#define SMALLPSIZE 4194304		// max primes in a segment below 2^32, sizes the power buffers
+#define SIEVEBOUND 2048			// primes from 127 to this are sieved in getsegprps local memory
 
 void handle_trickle_up(workStatus & st){
 	if(boinc_is_standalone()) return;
@@ -82,25 +96,47 @@ FILE *my_fopen(const char *filename, const char *mode){
 
 
 void cleanup(progData & pd){
-	sclReleaseMemObject(pd.d_primecount);
+	for(int s=0; s<2; ++s){
+		sclReleaseMemObject(pd.d_primecount[s]);
+		sclReleaseMemObject(pd.d_primes[s]);
+		for(int i=0; i<3; ++i){
+			sclReleaseMemObject(pd.d_powers[s][i]);
+		}
+		if(pd.genDone[s] != NULL) clReleaseEvent(pd.genDone[s]);
+		if(pd.mulDone[s] != NULL) clReleaseEvent(pd.mulDone[s]);
+	}
 	sclReleaseMemObject(pd.d_totalcount);
-	sclReleaseMemObject(pd.d_primes);
-	sclReleaseMemObject(pd.d_testprimedata);
+	sclReleaseMemObject(pd.d_sieveprime);
+	sclReleaseMemObject(pd.d_tppq);
+	sclReleaseMemObject(pd.d_tpconst);
+	sclReleaseMemObject(pd.d_chunk);
+	sclReleaseMemObject(pd.d_chunktp);
+	sclReleaseMemObject(pd.d_tpchunks);
+	sclReleaseMemObject(pd.d_chunktotal);
+	sclReleaseMemObject(pd.d_chunkticket);
+	sclReleaseMemObject(pd.d_tpindex);
 	sclReleaseMemObject(pd.d_residues);
-	sclReleaseMemObject(pd.d_grptotal);
+	for(int l=0; l<MAXLANES; ++l){
+		sclReleaseMemObject(pd.d_grptotal[l]);
+		sclReleaseMemObject(pd.d_ticket[l]);
+		// lane 0 is the main queue
+		if(l > 0 && pd.lane[l].queue != NULL) clReleaseCommandQueue(pd.lane[l].queue);
+	}
+	sclReleaseMemObject(pd.d_queue);
+	sclReleaseMemObject(pd.d_slotuse);
 	sclReleaseMemObject(pd.d_found);
 	sclReleaseMemObject(pd.d_acu);
-	for(int i=0; i<3; ++i){
-		sclReleaseMemObject(pd.d_powers[i]);
-	}
+	clReleaseCommandQueue(pd.gen.queue);
 	sclReleaseClSoft(pd.clearn);
 	sclReleaseClSoft(pd.clearresult);
         sclReleaseClSoft(pd.iterate);
         sclReleaseClSoft(pd.setup);
         sclReleaseClSoft(pd.getsegprps);
+        sclReleaseClSoft(pd.getsmprimes);
         sclReleaseClSoft(pd.mulsmall);
-        sclReleaseClSoft(pd.mullarge);
-        sclReleaseClSoft(pd.reduce);
+	for(int v=0; v<4; ++v){
+		sclReleaseClSoft(pd.mullarge[v]);
+	}
         sclReleaseClSoft(pd.finda);
         sclReleaseClSoft(pd.findc);
         sclReleaseClSoft(pd.findu);
@@ -288,9 +324,8 @@ int read_state( searchData & sd, workStatus & st, cl_ulong2 * residues ){
 }
 
 
-void checkpoint(searchData & sd, workStatus & st, cl_ulong2 * residues, int checkpointTime){
-	handle_trickle_up( st );
-	write_state( sd, st, residues );
+// st is the work status that was written
+void checkpointDone(searchData & sd, workStatus & st, int checkpointTime){
 	boinc_checkpoint_completed();
 	// display estimated time left if running standalone
 	if(boinc_is_standalone() && checkpointTime && !sd.test){
@@ -319,104 +354,144 @@ void checkpoint(searchData & sd, workStatus & st, cl_ulong2 * residues, int chec
 }
 
 
-void getDataFromGPU( progData & pd, searchData & sd, sclHard hardware, workStatus & st, cl_ulong2 *residues, uint32_t * h_primecount ){
+void checkpoint(searchData & sd, workStatus & st, cl_ulong2 * residues, int checkpointTime){
+	handle_trickle_up( st );
+	write_state( sd, st, residues );
+	checkpointDone( sd, st, checkpointTime );
+}
+
+
+// the residues are read back by the iterate stage, only the prp counters are left
+void getCountsFromGPU( progData & pd, sclHard hardware, workStatus & st, uint32_t * h_primecount ){
 
 	uint64_t h_totalcount;
 
-	// get residues from gpu (non-blocking)
-	sclReadNB(hardware, st.tpcount * sizeof(cl_ulong2), pd.d_residues, residues);
-
-	// copy prime count to host memory (non-blocking)
-	sclReadNB(hardware, 3*sizeof(uint32_t), pd.d_primecount, h_primecount);
+	// copy prime count of both buffer sets to host memory (non-blocking)
+	sclReadNB(hardware, 2*sizeof(uint32_t), pd.d_primecount[0], h_primecount);
+	sclReadNB(hardware, 2*sizeof(uint32_t), pd.d_primecount[1], h_primecount+2);
 
 	// copy total prime count to host memory (blocking)
 	sclRead(hardware, sizeof(uint64_t), pd.d_totalcount, &h_totalcount);
 
 	// largest kernel prime count.  used to check array bounds
-	if(h_primecount[1] > sd.psize){
+	if(h_primecount[1] > pd.pcap[0] || h_primecount[3] > pd.pcap[1]){
 		fprintf(stderr,"error: gpu prime array overflow\n");
 		printf("error: gpu prime array overflow\n");
 		exit(EXIT_FAILURE);
 	}
 
-	// flag set if there is a gpu overflow error
-	if(h_primecount[2] == 1){
-		fprintf(stderr,"error: getsegprps kernel local memory overflow\n");
-		printf("error: getsegprps kernel local memory overflow\n");
-		exit(EXIT_FAILURE);
-	}
-
 	// add total primes generated
 	st.totalcount += h_totalcount;
 
 }
 
 
-// sleep CPU thread while waiting on the specified event to complete in the command queue
-// using critical sections to prevent BOINC from shutting down the program while kernels are running on the GPU
-void waitOnEvent(sclHard hardware, cl_event event){
+// device completion is signalled by event callbacks through a condition variable
+// the wait times out after 1ms and polls the event, for platforms where callbacks are late or never arrive
+std::mutex event_mutex;
+std::condition_variable event_cv;
+uint64_t event_signals = 0;
 
-	cl_int err;
-	cl_int info;
-#ifdef _WIN32
-#else
-	struct timespec sleep_time;
-	sleep_time.tv_sec = 0;
-	sleep_time.tv_nsec = 1000000;	// 1ms
-#endif
 
-	boinc_begin_critical_section();
+void CL_CALLBACK eventCallback(cl_event event, cl_int status, void *data){
 
-	err = clFlush(hardware.queue);
+	{
+		std::lock_guard<std::mutex> lock(event_mutex);
+		++event_signals;
+	}
+	event_cv.notify_all();
+
+}
+
+
+// sleep CPU thread until the event is complete
+void waitForComplete(cl_event event){
+
+	cl_int err;
+	cl_int info = CL_QUEUED;
+
+	err = clSetEventCallback(event, CL_COMPLETE, eventCallback, NULL);
 	if ( err != CL_SUCCESS ) {
-		printf( "ERROR: clFlush\n" );
-		fprintf(stderr, "ERROR: clFlush\n" );
+		printf( "ERROR: clSetEventCallback\n" );
+		fprintf(stderr, "ERROR: clSetEventCallback\n" );
 		sclPrintErrorFlags( err );
        	}
 
 	while(true){
 
-#ifdef _WIN32
-		Sleep(1);
-#else
-		nanosleep(&sleep_time,NULL);
-#endif
+		// signal count is read before the status so a callback between the two is not missed
+		// the status is read without the lock, some runtimes run the callback while holding a lock clGetEventInfo needs
+		uint64_t signals;
+		{
+			std::lock_guard<std::mutex> lock(event_mutex);
+			signals = event_signals;
+		}
 
 		err = clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &info, NULL);
 		if ( err != CL_SUCCESS ) {
 			printf( "ERROR: clGetEventInfo\n" );
 			fprintf(stderr, "ERROR: clGetEventInfo\n" );
 			sclPrintErrorFlags( err );
+			exit(EXIT_FAILURE);
 	       	}
 
 		if(info == CL_COMPLETE){
-			err = clReleaseEvent(event);
-			if ( err != CL_SUCCESS ) {
-				printf( "ERROR: clReleaseEvent\n" );
-				fprintf(stderr, "ERROR: clReleaseEvent\n" );
-				sclPrintErrorFlags( err );
-		       	}
-
-			boinc_end_critical_section();
-
 			return;
 		}
+
+		// a negative status is an error code, the command was terminated
+		if(info < 0){
+			printf( "ERROR: command terminated with status %d\n", info );
+			fprintf(stderr, "ERROR: command terminated with status %d\n", info );
+			sclPrintErrorFlags( info );
+			exit(EXIT_FAILURE);
+		}
+
+		std::unique_lock<std::mutex> lock(event_mutex);
+		event_cv.wait_for(lock, std::chrono::milliseconds(1), [signals]{ return event_signals != signals; });
 	}
 }
 
 
+// sleep CPU thread while waiting on the specified event to complete in the command queue
+// using critical sections to prevent BOINC from shutting down the program while kernels are running on the GPU
+// returns the event's kernel run time in ms
+double waitOnEvent(sclHard hardware, cl_event event){
+
+	cl_int err;
+
+	boinc_begin_critical_section();
+
+	err = clFlush(hardware.queue);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clFlush\n" );
+		fprintf(stderr, "ERROR: clFlush\n" );
+		sclPrintErrorFlags( err );
+       	}
+
+	waitForComplete(event);
+
+	double ms = sclEventMs(event);
+
+	err = clReleaseEvent(event);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clReleaseEvent\n" );
+		fprintf(stderr, "ERROR: clReleaseEvent\n" );
+		sclPrintErrorFlags( err );
+       	}
+
+	boinc_end_critical_section();
+
+	return ms;
+
+}
+
+
 // queue a marker and sleep CPU thread until marker has been reached in the command queue
 void sleepCPU(sclHard hardware){
 
 	cl_event kernelsDone;
 	cl_int err;
-	cl_int info;
-#ifdef _WIN32
-#else
-	struct timespec sleep_time;
-	sleep_time.tv_sec = 0;
-	sleep_time.tv_nsec = 1000000;	// 1ms
-#endif
 
 	boinc_begin_critical_section();
 
@@ -443,38 +518,37 @@ void sleepCPU(sclHard hardware){
 		sclPrintErrorFlags( err );
        	}
 
-	while(true){
+	waitForComplete(kernelsDone);
 
-#ifdef _WIN32
-		Sleep(1);
-#else
-		nanosleep(&sleep_time,NULL);
-#endif
+	err = clReleaseEvent(kernelsDone);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clReleaseEvent\n" );
+		fprintf(stderr, "ERROR: clReleaseEvent\n" );
+		sclPrintErrorFlags( err );
+       	}
 
-		err = clGetEventInfo(kernelsDone, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &info, NULL);
-		if ( err != CL_SUCCESS ) {
-			printf( "ERROR: clGetEventInfo\n" );
-			fprintf(stderr, "ERROR: clGetEventInfo\n" );
-			sclPrintErrorFlags( err );
-	       	}
+	boinc_end_critical_section();
 
-		if(info == CL_COMPLETE){
-			err = clReleaseEvent(kernelsDone);
-			if ( err != CL_SUCCESS ) {
-				printf( "ERROR: clReleaseEvent\n" );
-				fprintf(stderr, "ERROR: clReleaseEvent\n" );
-				sclPrintErrorFlags( err );
-		       	}
+}
 
-			boinc_end_critical_section();
 
-			return;
-		}
+
+// residues of low mod the getsegprps mask primes 7 to 113, one byte each, 4 per uint
+// threads add their offset with 32 bit math instead of a 64 bit modulo per prime
+void lowResidues(uint64_t low, cl_uint8 & lowres){
+
+	const uint32_t q[27] = { 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67,
+				71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113 };
+
+	for(int i=0; i<8; ++i){
+		lowres.s[i] = 0;
+	}
+	for(int i=0; i<27; ++i){
+		lowres.s[i/4] |= (cl_uint)(low % q[i]) << (8*(i%4));
 	}
 }
 
 
-
 // find mod 30 wheel index based on starting N
 // this is used by gpu threads to iterate over the number line
 void findWheelOffset(uint64_t & start, int32_t & index){
@@ -688,7 +762,9 @@ void writeResult(uint64_t p, int32_t b){
 }
 
 
-void processResult(uint64_t p, uint64_t s0, uint64_t s1, uint32_t type, progData & pd, searchData & sd, sclHard hardware, uint64_t * prps, goodResult * gres){
+// (p-1)! + 1 (mod p^2) from the residue, called by the result threads in any order
+// the find kernels share their buffers, findlock serializes them
+wilsonResult processResult(uint64_t p, uint64_t s0, uint64_t s1, uint32_t type, progData & pd, searchData & sd, sclHard hardware, uint64_t * prps, std::mutex & findlock){
 
 	mpz_t residue, psq, mp, a, b;
 	
@@ -724,13 +800,13 @@ void processResult(uint64_t p, uint64_t s0, uint64_t s1, uint32_t type, progData
 			mpz_mod(residue, residue, psq);
 		}
 	}
-	if(i > sd.prpsremoved){
-		sd.prpsremoved = i;
-	}
-
 	if(type == 0){
-		int64_t uu = find_u(p, pd, hardware);
-		int64_t cc = find_c(p, pd, hardware);
+		int64_t uu, cc;
+		{
+			std::lock_guard<std::mutex> lock(findlock);
+			uu = find_u(p, pd, hardware);
+			cc = find_c(p, pd, hardware);
+		}
 		mpz_t mu, mc;
 		mpz_init(mu);
 		mpz_init(mc);		
@@ -799,7 +875,11 @@ void processResult(uint64_t p, uint64_t s0, uint64_t s1, uint32_t type, progData
 		mpz_clear(mc);
 	}
 	else if(type == 1){
-		int64_t aa = find_a(p, pd, hardware);
+		int64_t aa;
+		{
+			std::lock_guard<std::mutex> lock(findlock);
+			aa = find_a(p, pd, hardware);
+		}
 		mpz_t ma;
 		mpz_init(ma);
 		if(aa < 0){
@@ -861,6 +941,20 @@ void processResult(uint64_t p, uint64_t s0, uint64_t s1, uint32_t type, progData
 	mpz_clear(a);
 	mpz_clear(b);
 
+	return (wilsonResult){quot, rem, (uint32_t)i};
+}
+
+
+// results are committed in test prime order, so results.txt has the same lines for any thread count
+void commitResult(uint64_t p, uint32_t type, wilsonResult & r, searchData & sd, goodResult * gres){
+
+	const uint64_t quot = r.quot;
+	const uint64_t rem = r.rem;
+
+	if(r.prps > sd.prpsremoved){
+		sd.prpsremoved = r.prps;
+	}
+
 	// Verify our calculations were correct
 	// From Wilson’s theorem it follows that the Wilson quotient is an integer only if p is not composite
 	if(rem != 0){
@@ -1014,15 +1108,9 @@ goodResult * readGoodResultFile(searchData & sd, workStatus & st){
 }
 
 
-void getResults(progData & pd, searchData & sd, sclHard hardware, workStatus & st, cl_ulong2 *residues, testPrime *tp){
+// read and verify the file of 2-PRPs that are divided out of the residues
+uint64_t * readPrpFile(){
 
-	goodResult * gres = NULL;
-	
-	if(boinc_is_standalone()) printf("Finalizing results on cpu\n");
-	
-	if(sd.resultTest) gres = readGoodResultFile(sd, st);		
-	
-	// read file of 2-PRPs
 	FILE *in;
 	in = my_fopen("prps.dat", "rb");
 	if(in == NULL) {
@@ -1063,30 +1151,28 @@ void getResults(progData & pd, searchData & sd, sclHard hardware, workStatus & s
 		printf("prp file checksum error\n");
 		exit(EXIT_FAILURE);
 	}
-	// finalize each prime's result
-	for(uint32_t j=0; j<st.tpcount; ++j){
-		processResult(tp[j].p, residues[j].s0, residues[j].s1, tp[j].type, pd, sd, hardware, prps, gres);
-	}
-	
-	free(prps);	
 
-	if(sd.resultTest){	
-		if(sd.grescount != sd.gresmatch){
-			for(uint32_t j=0; j<sd.grescount; ++j){
-				if(gres[j].p){
-					fprintf(stderr,"error: result check failed! p: %" PRIu64 " was not found in results!\n", gres[j].p);
-					printf("error: result check failed! p: %" PRIu64 " was not found in results!\n", gres[j].p);
-				}
+	return prps;
+}
+
+
+// every known good result in the search range has to be matched by processResult
+void checkGoodResults(searchData & sd, goodResult * gres){
+
+	if(sd.grescount != sd.gresmatch){
+		for(uint32_t j=0; j<sd.grescount; ++j){
+			if(gres[j].p){
+				fprintf(stderr,"error: result check failed! p: %" PRIu64 " was not found in results!\n", gres[j].p);
+				printf("error: result check failed! p: %" PRIu64 " was not found in results!\n", gres[j].p);
 			}
-			exit(EXIT_FAILURE);
 		}
-		else{
-			fprintf(stderr,"All results matched result file!\n");
-			printf("All results matched result file!\n");
-		}
-		free(gres);
-	}	
-	
+		exit(EXIT_FAILURE);
+	}
+	else{
+		fprintf(stderr,"All results matched result file!\n");
+		printf("All results matched result file!\n");
+	}
+
 }
 
 
@@ -1181,85 +1267,228 @@ void setupSearch(searchData & sd, workStatus & st){
 }
 
 
-void profileGPU(progData & pd, searchData & sd, sclHard hardware){
+// zero all prp counters, only used when no segment is queued
+void clearPrimeCounts(progData & pd, sclHard hardware){
 
-	// calculate approximate chunk size based on gpu's compute units
-	cl_int err = 0;
-	
-	uint64_t calc_range = sd.computeunits * (uint64_t)1510000;
+	cl_uint zero[2] = {0, 0};
 
-	// limit kernel global size
-	if(calc_range > 4294900000){
-		calc_range = 4294900000;
+	sclWrite(hardware, 2*sizeof(cl_uint), pd.d_primecount[0], zero);
+	sclWrite(hardware, 2*sizeof(cl_uint), pd.d_primecount[1], zero);
+	sclEnqueueKernel(hardware, pd.clearresult);
+
+}
+
+
+// mul kernel workgroups for psize prps, the group totals of at least one test prime have to fit in grpbytes
+// and at most maxgroups
+uint32_t mulGroups(uint64_t psize, uint32_t muldiv, uint64_t grpbytes, uint64_t maxgroups){
+
+	uint64_t groups = (psize / muldiv + 255) / 256;
+	if(groups > grpbytes / sizeof(cl_ulong2)){
+		groups = grpbytes / sizeof(cl_ulong2);
+	}
+	if(groups > maxgroups){
+		groups = maxgroups;
+	}
+	if(groups == 0){
+		groups = 1;
 	}
-	
-	uint64_t start = 0xFFFFFFFF;
-	uint64_t stop = start + calc_range;
 
-	sclSetGlobalSize( pd.getsegprps, calc_range/60+1 );
+	return (uint32_t)groups;
+}
 
-	// get a count of primes in the gpu worksize
-	uint64_t range_primes = (stop / log(stop)) - (start / log(start));
 
-	// calculate prime array size based on result
-	uint64_t mem_size = (uint64_t)(1.5 * (double)range_primes);
+// mullarge's queue counter is a uint, it counts tpcount * numgroups work items
+// and one more take by each persistent workgroup when the segment is done
+uint64_t mulLargeGroups(searchData & sd, workStatus & st){
 
-	// kernels use uint for global id
-	if(mem_size > UINT32_MAX){
-		fprintf(stderr, "ERROR: mem_size too large.\n");
-                printf( "ERROR: mem_size too large.\n" );
+	const uint64_t persist = (uint64_t)sd.computeunits * PERSISTGROUPS;
+	const uint64_t tpcount = std::max(st.tpcount, (uint32_t)1);
+
+	return (persist < UINT32_MAX) ? (UINT32_MAX - persist) / tpcount : 0;
+}
+
+
+// persistent mullarge global size, about as many workgroups as the device keeps resident
+void setMulLargeSize(progData & pd, searchData & sd, workStatus & st){
+
+	const uint64_t items = (uint64_t)st.tpcount * sd.numgroups;
+	const uint64_t groups = std::min(items, (uint64_t)sd.computeunits*PERSISTGROUPS);
+
+	if( items + groups > UINT32_MAX ){
+		fprintf(stderr, "ERROR: mullarge work queue overflow, %" PRIu64 " items.\n", items);
+		printf( "ERROR: mullarge work queue overflow, %" PRIu64 " items.\n", items);
 		exit(EXIT_FAILURE);
 	}
 
-	pd.d_primes = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, mem_size*sizeof(cl_ulong), NULL, &err);
-        if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure d_primes\n");
-                printf( "ERROR: clCreateBuffer failure d_primes\n" );
+	for(int v=0; v<4; ++v){
+		sclSetGlobalSize( pd.mullarge[v], groups*256 );
+	}
+}
+
+
+// plan prp buffer memory from the device's global memory and max allocation size
+// half of global memory is budgeted, leaving room for the display, driver and other tasks
+// when psize prps don't fit, the 32 bit tables of the 3 prime types share one device table, then a single
+// buffer set is used without prefetching, then the segment is made smaller
+// returns the number of prps per buffer set, at most psize
+uint32_t planMemory(searchData & sd, workStatus & st, uint64_t psize){
+
+	const double budget = (double)sd.globalmem * 0.5;
+
+	// test prime list, constants, residues and index
+	const double fixed = (double)st.tpcount * (sizeof(cl_ulong) + 2*sizeof(cl_ulong2) + sizeof(cl_ulong4) + sizeof(cl_uint))
+				+ ACUBUFFER * sizeof(cl_ulong);
+
+	// group totals of a mul batch
+	sd.grpbuffer = std::min( (double)GRPBUFFER, std::min( (double)sd.maxmalloc, budget / 16 ) );
+
+	double avail = budget - fixed - (double)sd.grpbuffer;
+	if(avail < 0){
+		avail = 0;
+	}
+
+	// bytes per prp for a buffer set, only primes below 2^32 have stored powers, for at most SMALLPSIZE primes
+	const double setbytes = (sd.offsets) ? sizeof(cl_uint) : sizeof(cl_ulong);
+	const double powbytes = 3*sizeof(cl_ulong);
+	auto setsize = [&](double n){ return n * setbytes + std::min(n, (double)SMALLPSIZE) * powbytes; };
+
+	// double buffered when it fits, otherwise one set without prefetching
+	sd.bufsets = ( 2 * setsize((double)psize) <= avail ) ? 2 : 1;
+
+	// largest single buffer is the primes of a set
+	const double perset = avail / sd.bufsets;
+	double maxprps = ( perset >= setsize(SMALLPSIZE) ) ? (perset - SMALLPSIZE * powbytes) / setbytes : perset / (setbytes + powbytes);
+	maxprps = std::min( maxprps, (double)sd.maxmalloc / setbytes );
+	maxprps = std::min( maxprps, (double)UINT32_MAX );
+	sd.maxprps = (uint32_t)maxprps;
+
+	if(maxprps < 256){
+		fprintf(stderr, "ERROR: not enough GPU memory.\n");
+		printf( "ERROR: not enough GPU memory.\n" );
 		exit(EXIT_FAILURE);
 	}
-	for(int i=0; i<3; ++i){
-		pd.d_powers[i] = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, mem_size*sizeof(cl_uint2), NULL, &err);
+
+	if((double)psize > maxprps){
+		psize = (uint64_t)maxprps;
+	}
+
+	// mulsmall has its own divisor, its segments hold at most SMALLPSIZE primes
+	sd.numgroups = mulGroups(psize, sd.muldiv, sd.grpbuffer, mulLargeGroups(sd, st));
+	sd.numgroups32 = mulGroups(std::min(psize, (uint64_t)SMALLPSIZE), sd.muldiv32, sd.grpbuffer, UINT32_MAX);
+
+	return (uint32_t)psize;
+}
+
+
+void profileGPU(progData & pd, searchData & sd, workStatus & st, sclHard hardware){
+
+	// first guess of the chunk size from the gpu's compute units
+	cl_int err = 0;
+	
+	uint64_t calc_range = sd.computeunits * (uint64_t)1510000;
+
+	// the benchmark stores ulong prps, the planner picks the format below
+	sd.offsets = false;
+
+	uint64_t start = 0xFFFFFFFF;
+	uint64_t stop = start;
+	uint64_t range_primes = 0;
+	uint64_t mem_size = 0;
+
+	// the guess is profiled and scaled to the prp kernel target, while it is off by more than 2x
+	// the new range is profiled again, so no per vendor compute unit scaling is needed
+	for(int pass=0; pass<PROFILEPASSES; ++pass){
+
+		// limit kernel global size
+		calc_range = std::min(std::max(calc_range, (uint64_t)MINRANGE), (uint64_t)MAXRANGE);
+
+		stop = start + calc_range;
+
+		// get a count of primes in the gpu worksize
+		range_primes = (stop / log(stop)) - (start / log(start));
+
+		// calculate prime array size based on result
+		mem_size = (uint64_t)(1.5 * (double)range_primes);
+
+		// the profiling segment has to fit the memory plan too
+		uint64_t planned = planMemory(sd, st, mem_size);
+		if(planned < mem_size){
+			calc_range = (uint64_t)( (double)calc_range * (double)planned / (double)mem_size );
+			stop = start + calc_range;
+			mem_size = planned;
+		}
+
+		sclSetGlobalSize( pd.getsegprps, calc_range/60+1 );
+
+		// kernels use uint for global id
+		if(mem_size > UINT32_MAX){
+			fprintf(stderr, "ERROR: mem_size too large.\n");
+			printf( "ERROR: mem_size too large.\n" );
+			exit(EXIT_FAILURE);
+		}
+
+		pd.d_primes[0] = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, mem_size*sizeof(cl_ulong), NULL, &err);
 		if ( err != CL_SUCCESS ) {
-			fprintf(stderr, "ERROR: clCreateBuffer failure d_powers\n");
-			printf( "ERROR: clCreateBuffer failure d_powers\n" );
+			fprintf(stderr, "ERROR: clCreateBuffer failure d_primes\n");
+			printf( "ERROR: clCreateBuffer failure d_primes\n" );
 			exit(EXIT_FAILURE);
 		}
-	}
 
-	int32_t wheelidx;
-	uint64_t kernel_start = start;
-	findWheelOffset(kernel_start, wheelidx);
+		int32_t wheelidx;
+		uint64_t kernel_start = start;
+		findWheelOffset(kernel_start, wheelidx);
 
-	sclSetKernelArg(pd.getsegprps, 0, sizeof(uint64_t), &kernel_start);
-	sclSetKernelArg(pd.getsegprps, 1, sizeof(uint64_t), &stop);
-	sclSetKernelArg(pd.getsegprps, 2, sizeof(int32_t), &wheelidx);
-	sclSetKernelArg(pd.getsegprps, 3, sizeof(cl_mem), &pd.d_primes);
-	sclSetKernelArg(pd.getsegprps, 4, sizeof(cl_mem), &pd.d_primecount);
-	sclSetKernelArg(pd.getsegprps, 5, sizeof(cl_mem), &pd.d_powers[0]);
-	sclSetKernelArg(pd.getsegprps, 6, sizeof(cl_mem), &pd.d_powers[1]);
-	sclSetKernelArg(pd.getsegprps, 7, sizeof(cl_mem), &pd.d_powers[2]);
-	sclSetKernelArg(pd.getsegprps, 8, sizeof(uint64_t), &sd.typeTarget[0]);
-	sclSetKernelArg(pd.getsegprps, 9, sizeof(uint64_t), &sd.typeTarget[1]);
-	sclSetKernelArg(pd.getsegprps, 10, sizeof(uint64_t), &sd.typeTarget[2]);
-	sclSetKernelArg(pd.getsegprps, 11, sizeof(uint64_t), &sd.powerLimit[0]);
-	sclSetKernelArg(pd.getsegprps, 12, sizeof(uint64_t), &sd.powerLimit[1]);
-	sclSetKernelArg(pd.getsegprps, 13, sizeof(uint64_t), &sd.powerLimit[2]);
-
-	// zero prime count
-	sclEnqueueKernel(hardware, pd.clearresult);
+		sclSetKernelArg(pd.getsegprps, 0, sizeof(uint64_t), &kernel_start);
+		sclSetKernelArg(pd.getsegprps, 1, sizeof(uint64_t), &stop);
+		sclSetKernelArg(pd.getsegprps, 2, sizeof(int32_t), &wheelidx);
+		sclSetKernelArg(pd.getsegprps, 3, sizeof(cl_mem), &pd.d_primes[0]);
+		sclSetKernelArg(pd.getsegprps, 4, sizeof(cl_mem), &pd.d_primecount[0]);
+		sclSetKernelArg(pd.getsegprps, 5, sizeof(cl_mem), &pd.d_sieveprime);
+		cl_uint8 lowres;
+		lowResidues(kernel_start, lowres);
+		sclSetKernelArg(pd.getsegprps, 6, sizeof(cl_uint8), &lowres);
+		uint32_t offsets = 0;
+		sclSetKernelArg(pd.getsegprps, 7, sizeof(uint32_t), &offsets);
+
+		// zero prime count
+		clearPrimeCounts(pd, hardware);
+
+		// Benchmark the GPU
+		double kernel_ms = ProfilesclEnqueueKernel(hardware, pd.getsegprps);
+
+		// free temporary array
+		sclReleaseMemObject(pd.d_primes[0]);
+		pd.d_primes[0] = NULL;
 
-	// Benchmark the GPU
-	double kernel_ms = ProfilesclEnqueueKernel(hardware, pd.getsegprps);
+		// target runtime for prime generator kernel, 3.0 ms unless tuned
+		double prof_multi = sd.genms / kernel_ms;
 
-	// target runtime for prime generator kernel is approx 3.0 ms
-	double prof_multi = 3.0 / kernel_ms;
+		// update chunk size based on the profile
+		calc_range = (uint64_t)( (double)calc_range * prof_multi );
 
-	// update chunk size based on the profile
-	calc_range = (uint64_t)( (double)calc_range * prof_multi );
+		if(prof_multi > 0.5 && prof_multi < 2.0){
+			break;
+		}
+	}
 
 	// limit kernel global size
-	if(calc_range > 4294900000){
-		calc_range = 4294900000;
+	if(calc_range > MAXRANGE){
+		calc_range = MAXRANGE;
+	}
+
+	// prps are stored as uint offsets from the segment's low, half the memory and mullarge reads
+	// a wider segment keeps ulong prps only when the memory plan holds all of its prps
+	sd.offsets = true;
+	if(calc_range > OFFSETRANGE){
+		stop = start + calc_range;
+		range_primes = (stop / log(stop)) - (start / log(start));
+		mem_size = (uint64_t)( 1.5 * (double)range_primes );
+		sd.offsets = false;
+		if(planMemory(sd, st, mem_size) < mem_size){
+			sd.offsets = true;
+			calc_range = OFFSETRANGE;
+		}
 	}
 
 	// get a count of primes in the new gpu worksize
@@ -1270,6 +1499,13 @@ void profileGPU(progData & pd, searchData & sd, sclHard hardware){
 	// calculate prime array size based on result
 	mem_size = (uint64_t)( 1.5 * (double)range_primes );
 
+	// a smaller segment when the memory plan can't hold it
+	uint64_t planned = planMemory(sd, st, mem_size);
+	if(planned < mem_size){
+		calc_range = (uint64_t)( (double)calc_range * (double)planned / (double)mem_size );
+		mem_size = planned;
+	}
+
 	if(mem_size > UINT32_MAX){
 		fprintf(stderr, "ERROR: mem_size too large.\n");
                 printf( "ERROR: mem_size too large.\n" );
@@ -1278,118 +1514,157 @@ void profileGPU(progData & pd, searchData & sd, sclHard hardware){
 
 	sd.range = calc_range;
 	sd.psize = mem_size;
-	
-	fprintf(stderr, "r:%u p:%u\n",sd.range,sd.psize);
+	sd.psize32 = std::min( sd.psize, (uint32_t)SMALLPSIZE );
 
-	// free temporary arrays
-	sclReleaseMemObject(pd.d_primes);
-	for(int i=0; i<3; ++i){
-		sclReleaseMemObject(pd.d_powers[i]);
+	// segments below 2^32 are limited by the Brun-Titchmarsh bound, pi(x+y) - pi(x) <= 2y/log(y)
+	// it holds for any start, so the exact primes from getsmprimes can't overflow the power buffers
+	double bound = (double)sd.psize32 - 64;
+	double y = bound * 0.5 * log(bound);
+	while( y > 2.0 && 2.0 * y / log(y) > bound ){
+		y *= 0.95;
 	}
+	sd.range32 = std::min( (uint64_t)y, sd.range );
+	
+	fprintf(stderr, "r:%" PRIu64 " r32:%" PRIu64 " p:%u buffer sets:%u prps:%s\n",sd.range,sd.range32,sd.psize,sd.bufsets,(sd.offsets)?"offsets":"ulong");
 
 }
 
 
-cl_ulong2 getPower(uint32_t prime, uint64_t target){
+// end of the segment starting at start
+uint64_t segmentStop(searchData & sd, uint64_t start){
 
-	if(prime > target){
-		return (cl_ulong2){0,0};
-	}
-	uint64_t totalpower = 0;
-	uint64_t currp = prime;
-	uint64_t q = target / currp;
-	while(q){
-		totalpower += q;
-		unsigned __int128 pp = (unsigned __int128)currp * prime;
-		if(pp > target) break;
-		currp = pp;
-		q = target / currp;
+	uint64_t stop = start + ( (start < 0xFFFFFFFF) ? sd.range32 : sd.range );
+	if(stop > sd.maxtarget+1){
+		stop = sd.maxtarget+1;
 	}
-	uint64_t curBit = 0x8000000000000000;
-	if(totalpower > 1){
-		curBit >>= ( __builtin_clzll(totalpower) + 1 );
+	
+	if(start < 0xFFFFFFFF && stop > 0xFFFFFFFF){
+		stop = 0xFFFFFFFF;
 	}
-	return (cl_ulong2){totalpower, curBit};
+
+	return stop;
+
 }
 
 
-void get32bitprimes(sclHard hardware, progData & pd, searchData & sd, workStatus & st, uint64_t * smprime,
-			cl_ulong2 * smpower, cl_ulong * h_prime, cl_ulong2 * h_power, primesieve_iterator & it, uint64_t stop){
+// allocate a prp buffer set for sd.psize prps
+// old buffers are released, OpenCL keeps them until queued kernels using them are complete
+void allocSegmentBuffers(progData & pd, searchData & sd, uint32_t set){
 
-	// get a segment of primes
-	uint32_t smcount = 0;
-	for(; smcount < sd.psize; ++smcount){
-		uint64_t prime = primesieve_next_prime(&it);
-		if(prime >= stop){
-			prime = primesieve_prev_prime(&it);
-			break;
-		}
-		smprime[smcount] = prime;
+	cl_int err = 0;
+
+	if(pd.pcap[set]){
+		sclReleaseMemObject(pd.d_primes[set]);
 	}
 
-	// generate compressed prime and power tables for all 3 prime types
-	for(uint32_t t=0; t<3; ++t){
-		if(!sd.tpcnt[t] || smprime[0] > sd.typeTarget[t]){
-			sd.pcount32[t] = 0;
-			continue;
-		}
-		uint32_t newcount = smcount;
-		for(uint32_t b = 0; b < smcount; ++b){
-			if(smprime[b] > sd.typeTarget[t]){
-				newcount = b;
-				break;
-			}
-			smpower[b] = getPower(smprime[b], sd.typeTarget[t]);
-		}
-		// compress the power table by combining primes with the same power
-		// skip the first prime, therefore, the power table will have at least one term
-		h_prime[0] = smprime[0];
-		h_power[0] = smpower[0];
-		uint32_t m=1;
-		for(uint32_t i=1; i<newcount; ++m){
-			h_prime[m] = smprime[i];
-			h_power[m] = smpower[i];
-			for(++i; i<newcount && h_power[m].s0 == smpower[i].s0; ++i){
-				unsigned __int128 pp = (unsigned __int128)h_prime[m] * smprime[i];
-				if(pp > 0xFFFFFFFFFFFFFFFF) break;
-				h_prime[m] = pp;
-			}
-		}
-		sclWriteNB(hardware, m * sizeof(cl_ulong), pd.d_primes32[t], h_prime);
-		sclWrite(hardware, m * sizeof(cl_ulong2), pd.d_powers32[t], h_power);
-		sd.pcount32[t] = m;
+	// uint offsets or ulong prps, getsmprimes stores at most psize32 uint primes
+	const size_t prpbytes = (sd.offsets) ? sizeof(cl_uint) : sizeof(cl_ulong);
+	pd.d_primes[set] = clCreateBuffer(pd.gen.context, CL_MEM_READ_WRITE, sd.psize*prpbytes, NULL, &err);
+        if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure d_primes\n");
+                printf( "ERROR: clCreateBuffer failure d_primes\n" );
+		exit(EXIT_FAILURE);
 	}
-	
-	// add total primes generated
-	st.totalcount += smcount;	
+
+	pd.pcap[set] = sd.psize;
+
 }
 
 
-uint64_t getPrimes(sclHard hardware, progData & pd, searchData & sd, workStatus & st, uint64_t * smprime,
-			cl_ulong2 * smpower, cl_ulong * h_prime, cl_ulong2 * h_power, primesieve_iterator & it){
+// powers of each type for the primes below 2^32, mullarge computes the powers of larger primes
+// released once the segments are above 2^32
+void allocPowerBuffers(progData & pd, searchData & sd, uint32_t set){
 
-	uint64_t stop = st.currp + sd.range;
-	if(stop > sd.maxtarget+1){
-		stop = sd.maxtarget+1;
-	}
-	
-	if(st.currp < 0xFFFFFFFF && stop > 0xFFFFFFFF){
-		stop = 0xFFFFFFFF;
+	cl_int err = 0;
+
+	for(int i=0; i<3; ++i){
+		pd.d_powers[set][i] = clCreateBuffer(pd.gen.context, CL_MEM_READ_WRITE, sd.psize32*sizeof(cl_ulong), NULL, &err);
+		if ( err != CL_SUCCESS ) {
+			fprintf(stderr, "ERROR: clCreateBuffer failure d_powers\n");
+			printf( "ERROR: clCreateBuffer failure d_powers\n" );
+			exit(EXIT_FAILURE);
+		}
 	}
-	
-	if(st.currp < 0xFFFFFFFF){
-		get32bitprimes(hardware, pd, sd, st, smprime, smpower, h_prime, h_power, it, stop);
+
+}
+
+
+// generate prps in [start, stop) into buffer set on the generator queue
+// waits for the mul kernels of the last segment that used this buffer set
+void generateSegment(progData & pd, searchData & sd, uint64_t start, uint64_t stop, uint32_t set){
+
+	// the segment was resized larger than this buffer set
+	if(pd.pcap[set] < sd.psize){
+		allocSegmentBuffers(pd, sd, set);
+	}
+
+	int32_t wheelidx;
+	uint64_t kernel_start = start;
+	findWheelOffset(kernel_start, wheelidx);
+	pd.segbase[set] = kernel_start;
+
+	// exact primes below 2^32, 2-PRPs above.  both kernels use the same buffer set
+	// getsmprimes stores uint primes, getsegprps uint offsets from kernel_start or ulong prps
+	sclSoft & kernel = (start < 0xFFFFFFFF) ? pd.getsmprimes : pd.getsegprps;
+	int a = 0;
+	if(start < 0xFFFFFFFF){
+		sclSetKernelArg(kernel, a++, sizeof(uint64_t), &start);
+		sclSetGlobalSize( kernel, (stop - kernel_start)/60+1 );
+	}
+	sclSetKernelArg(kernel, a++, sizeof(uint64_t), &kernel_start);
+	sclSetKernelArg(kernel, a++, sizeof(uint64_t), &stop);
+	sclSetKernelArg(kernel, a++, sizeof(int32_t), &wheelidx);
+	sclSetKernelArg(kernel, a++, sizeof(cl_mem), &pd.d_primes[set]);
+	sclSetKernelArg(kernel, a++, sizeof(cl_mem), &pd.d_primecount[set]);
+	if(start < 0xFFFFFFFF){
+		sclSetKernelArg(kernel, a++, sizeof(cl_mem), &pd.d_powers[set][0]);
+		sclSetKernelArg(kernel, a++, sizeof(cl_mem), &pd.d_powers[set][1]);
+		sclSetKernelArg(kernel, a++, sizeof(cl_mem), &pd.d_powers[set][2]);
 	}
 	else{
-		int32_t wheelidx;
-		uint64_t kernel_start = st.currp;
-		findWheelOffset(kernel_start, wheelidx);
-		sclSetKernelArg(pd.getsegprps, 0, sizeof(uint64_t), &kernel_start);
-		sclSetKernelArg(pd.getsegprps, 1, sizeof(uint64_t), &stop);
-		sclSetKernelArg(pd.getsegprps, 2, sizeof(int32_t), &wheelidx);
-		sclEnqueueKernel(hardware, pd.getsegprps);
-//		float kernel_ms = ProfilesclEnqueueKernel(hardware, pd.getsegprps);
-//		printf("getsegprps %0.2fms\n",kernel_ms);
+		cl_uint8 lowres;
+		lowResidues(kernel_start, lowres);
+		sclSetKernelArg(kernel, 6, sizeof(cl_uint8), &lowres);
+		// mulsmall launches already queued for this set keep the power buffers until they finish
+		for(int i=0; i<3; ++i){
+			sclReleaseMemObject(pd.d_powers[set][i]);
+			pd.d_powers[set][i] = NULL;
+		}
+	}
+
+	if(pd.mulDone[set] != NULL){
+		sclEnqueueWaitForEvent(pd.gen, pd.mulDone[set]);
+	}
+	if(pd.genDone[set] != NULL){
+		clReleaseEvent(pd.genDone[set]);
+	}
+	pd.genDone[set] = sclEnqueueKernelEvent(pd.gen, kernel);
+	sclFlush(pd.gen);
+//	float kernel_ms = ProfilesclEnqueueKernel(pd.gen, pd.getsegprps);
+//	printf("getsegprps %0.2fms\n",kernel_ms);
+
+}
+
+
+// returns the end of the current segment
+// above 2^32 the next segment is generated into the other buffer set while this one is multiplied
+// prefetched is the end of the segment already generated, 0 if there is none
+uint64_t getPrimes(progData & pd, searchData & sd, workStatus & st, uint32_t set, uint64_t & prefetched){
+
+	// a prefetched segment keeps its size if the segment was resized since
+	uint64_t stop = (prefetched) ? prefetched : segmentStop(sd, st.currp);
+
+	if(!prefetched){
+		generateSegment(pd, sd, st.currp, stop, set);
+	}
+	prefetched = 0;
+	if(sd.bufsets == 2 && stop <= sd.maxtarget){
+		prefetched = segmentStop(sd, stop);
+		generateSegment(pd, sd, stop, prefetched, set^1);
+	}
+	// mul kernels on every lane wait for this segment's primes
+	for(uint32_t l=0; l<sd.lanes; ++l){
+		sclEnqueueWaitForEvent(pd.lane[l], pd.genDone[set]);
 	}
 
 	return stop;
@@ -1397,30 +1672,602 @@ uint64_t getPrimes(sclHard hardware, progData & pd, searchData & sd, workStatus
 }
 
 
-void multiply(sclHard hardware, progData & pd, searchData & sd, workStatus & st, uint32_t tpnum, uint32_t type){
+// mulsmall launch for a batch of count test primes of one type, below 2^32
+// each lane is an in-order queue with its own group totals and tickets
+void multiply(progData & pd, uint32_t tpstart, uint32_t count, uint32_t type, uint32_t set, uint32_t lane){
 
-	if(st.currp < 0xFFFFFFFF){
-		sclSetKernelArg(pd.mulsmall, 1, sizeof(cl_mem), &pd.d_primes32[type]);
-		sclSetKernelArg(pd.mulsmall, 2, sizeof(cl_mem), &pd.d_powers32[type]);
-		sclSetKernelArg(pd.mulsmall, 4, sizeof(uint32_t), &tpnum);
-		sclSetKernelArg(pd.mulsmall, 5, sizeof(uint32_t), &sd.pcount32[type]);
-		sclEnqueueKernel(hardware, pd.mulsmall);
-//		float kernel_ms = ProfilesclEnqueueKernel(hardware, pd.mulsmall);
-//		printf("mulsmall %0.2fms\n",kernel_ms);
+	sclHard hardware = pd.lane[lane];
+
+	sclSetKernelArg(pd.mulsmall, 3, sizeof(cl_mem), &pd.d_primes[set]);
+	sclSetKernelArg(pd.mulsmall, 4, sizeof(cl_mem), &pd.d_primecount[set]);
+	sclSetKernelArg(pd.mulsmall, 5, sizeof(cl_mem), &pd.d_powers[set][type]);
+	sclSetKernelArg(pd.mulsmall, 6, sizeof(cl_mem), &pd.d_grptotal[lane]);
+	sclSetKernelArg(pd.mulsmall, 7, sizeof(cl_mem), &pd.d_ticket[lane]);
+	sclSetKernelArg(pd.mulsmall, 9, sizeof(uint32_t), &tpstart);
+	pd.mulsmall.global_size[1] = count;
+	sclEnqueueKernel(hardware, pd.mulsmall);
+//	float kernel_ms = ProfilesclEnqueueKernel(hardware, pd.mulsmall);
+//	printf("mulsmall %0.2fms\n",kernel_ms);
+
+}
+
+
+// one mullarge launch on the main queue for the whole segment above 2^32
+// it covers the test primes of every type at or below its target, the types' index ranges, limits and targets
+// are compacted into the first components of the vector args, unused components end at the total count
+// stop is the end of the segment, it picks the mullarge variant
+// returns the launch's event, it times the segment
+cl_event multiplySegment(progData & pd, searchData & sd, workStatus & st, uint64_t stop, uint32_t set){
+
+	sclHard hardware = pd.lane[0];
+
+	cl_uint4 tpfirst = {{0, 0, 0, 0}};
+	cl_uint4 tpend = {{0, 0, 0, 0}};
+	cl_ulong4 limits = {{0, 0, 0, 0}};
+	cl_ulong4 targets = {{0, 0, 0, 0}};
+	uint32_t active = 0;
+	uint32_t first = 0;
+	uint32_t count = 0;
+
+	// power loads when the segment starts at or below an active type's power limit
+	// target checks when the segment ends past an active type's target
+	uint32_t v = 0;
+	for(uint32_t j=0; j<3; ++j){
+		if(st.currp <= sd.typeTarget[j] && sd.tpcnt[j] > 0){
+			count += sd.tpcnt[j];
+			tpfirst.s[active] = first;
+			tpend.s[active] = count;
+			limits.s[active] = sd.powerLimit[j];
+			targets.s[active] = sd.typeTarget[j];
+			++active;
+			if(st.currp <= sd.powerLimit[j]) v |= 1;
+			if(stop > sd.typeTarget[j]) v |= 2;
+		}
+		first += sd.tpcnt[j];
+	}
+	for(; active<4; ++active){
+		tpend.s[active] = count;
+	}
+
+	sclSoft & mullarge = pd.mullarge[v];
+	sclSetKernelArg(mullarge, 3, sizeof(cl_mem), &pd.d_primes[set]);
+	sclSetKernelArg(mullarge, 4, sizeof(cl_mem), &pd.d_primecount[set]);
+	sclSetKernelArg(mullarge, 9, sizeof(cl_uint4), &tpfirst);
+	sclSetKernelArg(mullarge, 10, sizeof(cl_uint4), &tpend);
+	sclSetKernelArg(mullarge, 11, sizeof(cl_ulong4), &limits);
+	sclSetKernelArg(mullarge, 12, sizeof(cl_ulong4), &targets);
+	sclSetKernelArg(mullarge, 15, sizeof(uint64_t), &pd.segbase[set]);
+	cl_event launchEvent = sclEnqueueKernelEvent(hardware, mullarge);
+//	float kernel_ms = ProfilesclEnqueueKernel(hardware, mullarge);
+//	printf("mullarge %0.2fms\n",kernel_ms);
+
+	return launchEvent;
+}
+
+
+// split each test prime's range (type target, prime target] into chunks of at most chunksize numbers
+// so the iterate workgroups have about equal work.  the chunk size is the average range, this gives
+// at most 2 * tpcount chunks.  returns the number of chunks, h_chunktp is the test prime of each chunk
+uint32_t iterateChunks(progData & pd, searchData & sd, workStatus & st, sclHard hardware, testPrime * tp, uint32_t * & h_chunktp){
+
+	cl_int err = 0;
+
+	long double work = 0;
+	for(uint32_t i=0; i<st.tpcount; ++i){
+		work += (long double)(tp[i].pTarget - sd.typeTarget[tp[i].type]);
 	}
-	else{
-		sclSetKernelArg(pd.mullarge, 3, sizeof(cl_mem), &pd.d_powers[type]);
-		sclSetKernelArg(pd.mullarge, 5, sizeof(uint32_t), &tpnum);
-		sclSetKernelArg(pd.mullarge, 6, sizeof(uint64_t), &sd.powerLimit[type]);
-		sclSetKernelArg(pd.mullarge, 7, sizeof(uint64_t), &sd.typeTarget[type]);
-		sclEnqueueKernel(hardware, pd.mullarge);
-//		float kernel_ms = ProfilesclEnqueueKernel(hardware, pd.mullarge);
-//		printf("mullarge %0.2fms\n",kernel_ms);
+	uint64_t chunksize = (uint64_t)ceill(work / st.tpcount);
+	if(chunksize < sd.lsize){
+		chunksize = sd.lsize;
+	}
+
+	// an empty range still gets one chunk, its workgroup converts the residue
+	uint32_t chunkcount = 0;
+	for(uint32_t i=0; i<st.tpcount; ++i){
+		uint64_t len = tp[i].pTarget - sd.typeTarget[tp[i].type];
+		chunkcount += (len) ? (uint32_t)((len + chunksize - 1) / chunksize) : 1;
+	}
+
+	cl_ulong2 * h_chunk = (cl_ulong2 *)malloc(chunkcount * sizeof(cl_ulong2));
+	h_chunktp = (uint32_t *)malloc(chunkcount * sizeof(uint32_t));
+	cl_uint2 * h_tpchunks = (cl_uint2 *)malloc(st.tpcount * sizeof(cl_uint2));
+	uint32_t * h_chunkticket = (uint32_t *)calloc(st.tpcount, sizeof(uint32_t));
+	if( h_chunk == NULL || h_chunktp == NULL || h_tpchunks == NULL || h_chunkticket == NULL ){
+		fprintf(stderr,"malloc error, iterate chunks\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t c = 0;
+	for(uint32_t i=0; i<st.tpcount; ++i){
+		uint64_t first = sd.typeTarget[tp[i].type] + 1;
+		h_tpchunks[i].s[0] = c;
+		do{
+			uint64_t last = std::min(first + chunksize - 1, tp[i].pTarget);
+			h_chunk[c].s[0] = first;
+			h_chunk[c].s[1] = last;
+			h_chunktp[c++] = i;
+			first = last + 1;
+		}while(first <= tp[i].pTarget);
+		h_tpchunks[i].s[1] = c - h_tpchunks[i].s[0];
+	}
+
+	pd.d_chunk = clCreateBuffer(hardware.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, chunkcount*sizeof(cl_ulong2), h_chunk, &err);
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure d_chunk\n");
+		printf( "ERROR: clCreateBuffer failure d_chunk\n" );
+		exit(EXIT_FAILURE);
+	}
+	pd.d_chunktp = clCreateBuffer(hardware.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, chunkcount*sizeof(cl_uint), h_chunktp, &err);
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure d_chunktp\n");
+		printf( "ERROR: clCreateBuffer failure d_chunktp\n" );
+		exit(EXIT_FAILURE);
+	}
+	pd.d_tpchunks = clCreateBuffer(hardware.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, st.tpcount*sizeof(cl_uint2), h_tpchunks, &err);
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure d_tpchunks\n");
+		printf( "ERROR: clCreateBuffer failure d_tpchunks\n" );
+		exit(EXIT_FAILURE);
+	}
+	pd.d_chunkticket = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, st.tpcount*sizeof(cl_uint), h_chunkticket, &err);
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure d_chunkticket\n");
+		printf( "ERROR: clCreateBuffer failure d_chunkticket\n" );
+		exit(EXIT_FAILURE);
+	}
+	pd.d_chunktotal = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, chunkcount*sizeof(cl_ulong2), NULL, &err);
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure d_chunktotal\n");
+		printf( "ERROR: clCreateBuffer failure d_chunktotal\n" );
+		exit(EXIT_FAILURE);
+	}
+
+	free(h_chunk);
+	free(h_tpchunks);
+	free(h_chunkticket);
+
+	return chunkcount;
+}
+
+
+// explicit dependencies between the queues, the segment's clearn on the main queue
+// waits for a marker after the last mul launch on each of the other lanes
+void joinLanes(progData & pd, searchData & sd, sclHard hardware){
+
+	for(uint32_t l=1; l<sd.lanes; ++l){
+		cl_event laneDone;
+		cl_int err = clEnqueueMarker(pd.lane[l].queue, &laneDone);
+		if ( err != CL_SUCCESS ) {
+			printf( "ERROR: clEnqueueMarker\n");
+			fprintf(stderr, "ERROR: clEnqueueMarker\n");
+			sclPrintErrorFlags(err);
+			exit(EXIT_FAILURE);
+		}
+		sclFlush(pd.lane[l]);
+		sclEnqueueWaitForEvent(hardware, laneDone);
+		clReleaseEvent(laneDone);
+	}
+
+}
+
+
+// the other lanes wait for all work queued so far on the main queue
+void forkLanes(progData & pd, searchData & sd, sclHard hardware){
+
+	if(sd.lanes == 1){
+		return;
+	}
+
+	cl_event mainDone;
+	cl_int err = clEnqueueMarker(hardware.queue, &mainDone);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clEnqueueMarker\n");
+		fprintf(stderr, "ERROR: clEnqueueMarker\n");
+		sclPrintErrorFlags(err);
+		exit(EXIT_FAILURE);
+	}
+	for(uint32_t l=1; l<sd.lanes; ++l){
+		sclEnqueueWaitForEvent(pd.lane[l], mainDone);
+	}
+	clReleaseEvent(mainDone);
+
+}
+
+
+// limit the cl queue depth of every lane and sleep cpu
+// each lane gets a marker after its launches and is flushed, then the cpu waits for the lanes' previous markers
+// so about maxq launches stay queued behind the one running.  drain waits for the new markers too
+void throttleLanes(progData & pd, searchData & sd, bool drain){
+
+	cl_event marker[MAXLANES];
+
+	for(uint32_t l=0; l<sd.lanes; ++l){
+		cl_int err = clEnqueueMarker(pd.lane[l].queue, &marker[l]);
+		if ( err != CL_SUCCESS ) {
+			printf( "ERROR: clEnqueueMarker\n");
+			fprintf(stderr, "ERROR: clEnqueueMarker\n");
+			sclPrintErrorFlags(err);
+			exit(EXIT_FAILURE);
+		}
+		sclFlush(pd.lane[l]);
+	}
+
+	for(uint32_t l=0; l<sd.lanes; ++l){
+		if(pd.throttle[l] != NULL){
+			waitOnEvent(pd.lane[l], pd.throttle[l]);
+		}
+		pd.throttle[l] = marker[l];
+		if(drain){
+			waitOnEvent(pd.lane[l], pd.throttle[l]);
+			pd.throttle[l] = NULL;
+		}
 	}
 
 }
 
 
+// checkpoints during the search are written by a writer thread while the device continues
+// the snapshot reads are queued on the main queue after the last segment's clearn, the other lanes
+// wait for them, so the residues match the snapshot's currp.  one snapshot is in flight at a time
+typedef struct {
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cv;
+	workStatus st;			// work status of the snapshot
+	cl_ulong2 * residues;		// pinned, not used by the main thread during the search
+	cl_event ready;			// last snapshot read
+	uint64_t h_totalcount;
+	uint32_t h_primecount[2];	// largest kernel prp count of each buffer set
+	uint32_t pcap[2];
+	int ckpt_time;
+	bool pending;			// snapshot queued, not yet written
+	bool written;			// written, boinc not yet told
+	bool quit;
+}checkpointWriter;
+
+
+void checkpointWriterLoop(checkpointWriter & cw, searchData & sd){
+
+	std::unique_lock<std::mutex> lock(cw.mutex);
+
+	while(true){
+
+		cw.cv.wait(lock, [&cw]{ return cw.pending || cw.quit; });
+		if(!cw.pending){
+			return;
+		}
+		lock.unlock();
+
+		waitForComplete(cw.ready);
+		clReleaseEvent(cw.ready);
+
+		if(cw.h_primecount[0] > cw.pcap[0] || cw.h_primecount[1] > cw.pcap[1]){
+			fprintf(stderr,"error: gpu prime array overflow\n");
+			printf("error: gpu prime array overflow\n");
+			exit(EXIT_FAILURE);
+		}
+
+		// the device total is kept for the whole search, the work status has the total at the start
+		cw.st.totalcount += cw.h_totalcount;
+		write_state( sd, cw.st, cw.residues );
+
+		lock.lock();
+		cw.pending = false;
+		cw.written = true;
+		cw.cv.notify_all();
+	}
+
+}
+
+
+// tell boinc about a checkpoint the writer has finished
+void collectCheckpoint(searchData & sd, checkpointWriter & cw){
+
+	std::lock_guard<std::mutex> lock(cw.mutex);
+	if(cw.written){
+		cw.written = false;
+		checkpointDone( sd, cw.st, cw.ckpt_time );
+	}
+
+}
+
+
+// queue non-blocking reads of the residues and counters and hand them to the writer thread
+// only called between segments, when every mul launch up to st.currp is queued
+void snapshotState(progData & pd, searchData & sd, workStatus & st, sclHard hardware, checkpointWriter & cw, int ckpt_time){
+
+	cl_int err;
+
+	// the writer is usually done long before the next checkpoint
+	{
+		std::unique_lock<std::mutex> lock(cw.mutex);
+		cw.cv.wait(lock, [&cw]{ return !cw.pending; });
+	}
+	collectCheckpoint(sd, cw);
+
+	handle_trickle_up( st );
+	cw.st = st;
+	cw.ckpt_time = ckpt_time;
+
+	sclReadNB(hardware, st.tpcount * sizeof(cl_ulong2), pd.d_residues, cw.residues);
+
+	// only the largest kernel prp counts, the generator queue may be writing a prefetched segment's count
+	for(int s=0; s<2; ++s){
+		cw.pcap[s] = pd.pcap[s];
+		err = clEnqueueReadBuffer(hardware.queue, pd.d_primecount[s], CL_FALSE, sizeof(cl_uint), sizeof(cl_uint), &cw.h_primecount[s], 0, NULL, NULL);
+		if ( err != CL_SUCCESS ) {
+			printf( "ERROR: clEnqueueReadBuffer\n");
+			fprintf(stderr, "ERROR: clEnqueueReadBuffer\n");
+			sclPrintErrorFlags(err);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	err = clEnqueueReadBuffer(hardware.queue, pd.d_totalcount, CL_FALSE, 0, sizeof(cl_ulong), &cw.h_totalcount, 0, NULL, &cw.ready);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clEnqueueReadBuffer\n");
+		fprintf(stderr, "ERROR: clEnqueueReadBuffer\n");
+		sclPrintErrorFlags(err);
+		exit(EXIT_FAILURE);
+	}
+	sclFlush(hardware);
+
+	// the next segment's mul launches on the other lanes wait for the reads
+	forkLanes(pd, sd, hardware);
+
+	{
+		std::lock_guard<std::mutex> lock(cw.mutex);
+		cw.pending = true;
+	}
+	cw.cv.notify_all();
+
+}
+
+
+// the pending snapshot is written before the thread exits
+void stopCheckpointWriter(checkpointWriter & cw){
+
+	if(!cw.thread.joinable()){
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(cw.mutex);
+		cw.quit = true;
+	}
+	cw.cv.notify_all();
+	cw.thread.join();
+
+}
+
+
+// test primes are finalized by a pool of threads while later iterate batches run on the device
+// each batch that completes test primes queues a non-blocking read of their residues
+// the worker loads prps.dat and the good result file while the search runs, then waits for the reads
+typedef struct {
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::mutex findlock;		// the find kernels share their buffers
+	cl_event * ready;		// residue read of each batch
+	uint32_t * tpend;		// the residues of test primes below tpend are in the batch's read
+	uint32_t batches;		// reads queued, at most one per test prime
+	uint32_t avail;			// test primes with residues on the host
+	uint32_t next;			// next test prime to finalize
+	uint32_t committed;		// results committed in test prime order
+	wilsonResult * result;
+	bool * finished;
+	uint64_t * prps;
+	goodResult * gres;
+}resultWorker;
+
+
+// take the next test prime with a residue, the thread that finishes the oldest uncommitted one commits
+void resultPoolLoop(resultWorker & rw, progData & pd, searchData & sd, workStatus & st, testPrime * tp, cl_ulong2 * residues){
+
+	std::unique_lock<std::mutex> lock(rw.mutex);
+
+	while(true){
+
+		rw.cv.wait(lock, [&rw, &st]{ return rw.next < rw.avail || rw.next == st.tpcount; });
+		if(rw.next == st.tpcount){
+			return;
+		}
+		const uint32_t j = rw.next++;
+		if(rw.next == st.tpcount){
+			rw.cv.notify_all();
+		}
+		lock.unlock();
+
+		// the find kernels use the generator queue, it is idle once the segments are done
+		rw.result[j] = processResult(tp[j].p, residues[j].s0, residues[j].s1, tp[j].type, pd, sd, pd.gen, rw.prps, rw.findlock);
+
+		lock.lock();
+		rw.finished[j] = true;
+		while(rw.committed < st.tpcount && rw.finished[rw.committed]){
+			const uint32_t c = rw.committed++;
+			commitResult(tp[c].p, tp[c].type, rw.result[c], sd, rw.gres);
+		}
+	}
+
+}
+
+
+void resultWorkerLoop(resultWorker & rw, progData & pd, searchData & sd, workStatus & st, testPrime * tp, cl_ulong2 * residues){
+
+	rw.prps = readPrpFile();
+	rw.gres = NULL;
+	if(sd.resultTest){
+		rw.gres = readGoodResultFile(sd, st);
+	}
+
+	// one finalizing thread per cpu, they wait for the first residues
+	const uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+	std::thread * pool = new std::thread[threads];
+	for(uint32_t t=0; t<threads; ++t){
+		pool[t] = std::thread(resultPoolLoop, std::ref(rw), std::ref(pd), std::ref(sd), std::ref(st), tp, residues);
+	}
+
+	for(uint32_t b = 0; rw.avail < st.tpcount; ++b){
+		{
+			std::unique_lock<std::mutex> lock(rw.mutex);
+			rw.cv.wait(lock, [&rw, b]{ return rw.batches > b; });
+		}
+		waitForComplete(rw.ready[b]);
+		clReleaseEvent(rw.ready[b]);
+		{
+			std::lock_guard<std::mutex> lock(rw.mutex);
+			rw.avail = rw.tpend[b];
+		}
+		rw.cv.notify_all();
+	}
+
+	for(uint32_t t=0; t<threads; ++t){
+		pool[t].join();
+	}
+	delete [] pool;
+
+	free(rw.prps);
+
+	if(sd.resultTest){
+		checkGoodResults(sd, rw.gres);
+		free(rw.gres);
+	}
+
+}
+
+
+// read back the residues of test primes [tpstart, tpend) after the iterate batches queued so far
+void streamResidues(progData & pd, sclHard hardware, resultWorker & rw, cl_ulong2 * residues, uint32_t tpstart, uint32_t tpend){
+
+	cl_event ready;
+	cl_int err = clEnqueueReadBuffer(hardware.queue, pd.d_residues, CL_FALSE, tpstart * sizeof(cl_ulong2),
+						(tpend - tpstart) * sizeof(cl_ulong2), residues + tpstart, 0, NULL, &ready);
+	if ( err != CL_SUCCESS ) {
+		printf( "ERROR: clEnqueueReadBuffer\n");
+		fprintf(stderr, "ERROR: clEnqueueReadBuffer\n");
+		sclPrintErrorFlags(err);
+		exit(EXIT_FAILURE);
+	}
+	sclFlush(hardware);
+
+	{
+		std::lock_guard<std::mutex> lock(rw.mutex);
+		rw.ready[rw.batches] = ready;
+		rw.tpend[rw.batches] = tpend;
+		++rw.batches;
+	}
+	rw.cv.notify_all();
+
+}
+
+
+// segments queued before the lanes' previous throttle markers are done, add their gen and mul run times
+// a sample is scaled to the current segment range, prefetched segments keep their size after a resize
+// the samples left are before the lanes' latest markers, they are done after the next throttle wait
+void sampleSegments(searchData & sd, segmentTimer & timer){
+
+	for(uint32_t i=0; i<timer.nmarked; ++i){
+		segmentSample & sample = timer.pending[i];
+		const double scale = (double)sd.range / (double)sample.range;
+		double ms = sclEventMs(sample.gen);
+		if(ms > 0.0){
+			timer.genms += ms * scale;
+			++timer.gencount;
+		}
+		ms = sclEventMs(sample.mul);
+		if(ms > 0.0){
+			timer.mulms += ms * scale;
+			++timer.mulcount;
+		}
+		clReleaseEvent(sample.gen);
+		clReleaseEvent(sample.mul);
+	}
+
+	for(uint32_t i=timer.nmarked; i<timer.npending; ++i){
+		timer.pending[i - timer.nmarked] = timer.pending[i];
+	}
+	timer.npending -= timer.nmarked;
+	timer.nmarked = timer.npending;
+
+}
+
+
+// resize the segment so the longest kernel keeps the run time measured in the first ADAPTSEGS segments above 2^32
+// prp density, the power limit transition and test prime types finishing all change the cost of a segment
+void adaptSegment(progData & pd, searchData & sd, workStatus & st, segmentTimer & timer){
+
+	double genms = (timer.gencount) ? timer.genms / timer.gencount : 0.0;
+	double mulms = (timer.mulcount) ? timer.mulms / timer.mulcount : 0.0;
+	double kernelms = std::max(genms, mulms);
+
+	timer.genms = 0.0;
+	timer.mulms = 0.0;
+	timer.gencount = 0;
+	timer.mulcount = 0;
+	timer.segments = 0;
+
+	// no profiling info
+	if(kernelms <= 0.0){
+		return;
+	}
+
+	if(timer.target == 0.0){
+		timer.target = kernelms;
+		fprintf(stderr, "Segment kernel target %0.2fms\n", timer.target);
+		return;
+	}
+
+	// ignore small changes
+	double scale = timer.target / kernelms;
+	if(scale > 0.9 && scale < 1.1){
+		return;
+	}
+	scale = std::min(std::max(scale, 0.5), 2.0);
+
+	double range = (double)sd.range * scale;
+
+	// limit kernel global size
+	range = std::min(std::max(range, (double)MINRANGE), (double)((sd.offsets) ? OFFSETRANGE : MAXRANGE));
+
+	// prps in the new segment, with the same margin as profileGPU
+	double start = (double)st.currp;
+	double stop = start + range;
+	double need = 1.5 * ( (stop / log(stop)) - (start / log(start)) );
+
+	// buffer sets have to fit the memory plan
+	double maxprps = (double)sd.maxprps;
+	if(need > maxprps){
+		range *= maxprps / need;
+		need = maxprps;
+	}
+
+	if((uint64_t)range == sd.range){
+		return;
+	}
+
+	sd.range = (uint64_t)range;
+	sclSetGlobalSize( pd.getsegprps, sd.range/60+1 );
+
+	// buffer sets are reallocated before their next use, they never shrink
+	// mullarge's parts per test prime follow psize, the ring keeps as many slots as lane 0's buffer holds
+	if((uint32_t)need > sd.psize){
+		sd.psize = (uint32_t)need;
+		sd.numgroups = mulGroups(sd.psize, sd.muldiv, pd.grpcap, mulLargeGroups(sd, st));
+		sd.slots = pd.grpcap / (sd.numgroups * sizeof(cl_ulong2));
+		if(sd.slots > RINGSLOTS) sd.slots = RINGSLOTS;
+		setMulLargeSize(pd, sd, st);
+		for(int v=0; v<4; ++v){
+			sclSetKernelArg(pd.mullarge[v], 13, sizeof(uint32_t), &sd.numgroups);
+			sclSetKernelArg(pd.mullarge[v], 17, sizeof(uint32_t), &sd.slots);
+		}
+	}
+
+	fprintf(stderr, "Segment resized, kernel %0.2fms target %0.2fms r:%" PRIu64 " p:%u\n", kernelms, timer.target, sd.range, sd.psize);
+
+}
+
+
 void getFractionDone(searchData & sd, workStatus & st, double partial){
 
 	// simplified fraction done.  fraction done will speed up as workunit progresses.
@@ -1439,6 +2286,53 @@ void getFractionDone(searchData & sd, workStatus & st, double partial){
 }
 
 
+// build option for subgroup shuffle reductions, empty when the device has none
+const char * subgroupOption( sclHard hardware, searchData & sd ){
+
+	const char * option = "";
+	size_t size = 0;
+	cl_int err = clGetDeviceInfo(hardware.device, CL_DEVICE_EXTENSIONS, 0, NULL, &size);
+	if (err != CL_SUCCESS || size == 0) {
+		return option;
+	}
+	char * ext = (char *)malloc(size);
+	if( ext == NULL ){
+		fprintf(stderr,"malloc error, device extensions\n");
+		exit(EXIT_FAILURE);
+	}
+	err = clGetDeviceInfo(hardware.device, CL_DEVICE_EXTENSIONS, size, ext, NULL);
+	if (err != CL_SUCCESS) {
+		free(ext);
+		return option;
+	}
+
+	// khr subgroup functions need OpenCL C 2.0
+	char clc[256];
+	int clc_major = 1;
+	if( clGetDeviceInfo(hardware.device, CL_DEVICE_OPENCL_C_VERSION, sizeof(clc), clc, NULL) == CL_SUCCESS ){
+		sscanf(clc, "OpenCL C %d", &clc_major);
+	}
+
+	if( strstr(ext, "cl_intel_subgroups") != NULL ){
+		option = " -DSG_INTEL";
+	}
+	else if( sd.nvidia ){
+		option = " -DSG_NV";
+	}
+	else if( clc_major >= 2 && strstr(ext, "cl_khr_subgroups") != NULL && strstr(ext, "cl_khr_subgroup_shuffle") != NULL ){
+		option = " -cl-std=CL2.0 -DSG_KHR";
+	}
+
+	free(ext);
+
+	if(option[0]){
+		fprintf(stderr, "Using subgroup reductions:%s\n", option);
+	}
+
+	return option;
+}
+
+
 void cl_wilson( sclHard hardware, searchData & sd, workStatus & st ){
 
 	progData pd = {};
@@ -1451,78 +2345,65 @@ void cl_wilson( sclHard hardware, searchData & sd, workStatus & st ){
 
 	// arrays used to transfer data from gpu during checkpoints
 	cl_ulong2 *residues;
-	uint32_t * h_primecount = (uint32_t *)malloc(3*sizeof(uint32_t));
+	uint32_t * h_primecount = (uint32_t *)malloc(4*sizeof(uint32_t));
 	if( h_primecount == NULL ){
 		fprintf(stderr,"malloc error, h_primecount\n");
 		exit(EXIT_FAILURE);
 	}
-	pd.d_primecount = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, 3*sizeof(cl_uint), NULL, &err );
+	for(int i=0; i<2; ++i){
+		pd.d_primecount[i] = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, 2*sizeof(cl_uint), NULL, &err );
+	        if ( err != CL_SUCCESS ) {
+			fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+	                printf( "ERROR: clCreateBuffer failure.\n" );
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// second in-order queue for prp generation, the next segment is generated while the current one is multiplied
+	pd.gen = hardware;
+	pd.gen.queue = clCreateCommandQueue(hardware.context, hardware.device, CL_QUEUE_PROFILING_ENABLE, &err);
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateCommandQueue failure.\n");
+		printf( "ERROR: clCreateCommandQueue failure.\n" );
+		exit(EXIT_FAILURE);
+	}
+	// mul launches are spread over lanes of in-order queues, devices that run kernels concurrently can overlap them
+	// a test prime is always on the same lane, so its residue updates stay in order
+	pd.lane[0] = hardware;
+	for(uint32_t l=1; l<sd.lanes; ++l){
+		pd.lane[l] = hardware;
+		pd.lane[l].queue = clCreateCommandQueue(hardware.context, hardware.device, CL_QUEUE_PROFILING_ENABLE, &err);
+		if ( err != CL_SUCCESS ) {
+			fprintf(stderr, "ERROR: clCreateCommandQueue failure.\n");
+			printf( "ERROR: clCreateCommandQueue failure.\n" );
+			exit(EXIT_FAILURE);
+		}
+	}
+	pd.d_totalcount = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, sizeof(cl_ulong), NULL, &err );
         if ( err != CL_SUCCESS ) {
 		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
                 printf( "ERROR: clCreateBuffer failure.\n" );
 		exit(EXIT_FAILURE);
 	}
-	pd.d_totalcount = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, sizeof(cl_ulong), NULL, &err );
+
+	// primes for the getsegprps local sieve, their count is a build option
+	size_t sievecount;
+	uint32_t *sieveprimes = (uint32_t*)primesieve_generate_primes(127, SIEVEBOUND, &sievecount, UINT32_PRIMES);
+	pd.d_sieveprime = clCreateBuffer( hardware.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sievecount*sizeof(cl_uint), sieveprimes, &err );
         if ( err != CL_SUCCESS ) {
 		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
                 printf( "ERROR: clCreateBuffer failure.\n" );
 		exit(EXIT_FAILURE);
 	}
+	free(sieveprimes);
 
-	// build kernels
-        pd.setup = sclGetCLSoftwareWithCommon(common_cl, setup_cl,"setup",hardware,NULL);
-        pd.iterate = sclGetCLSoftwareWithCommon(common_cl, iterate_cl,"iterate",hardware,NULL);
-        pd.mulsmall = sclGetCLSoftwareWithCommon(common_cl, mulsmall_cl,"mulsmall",hardware,NULL);
-        pd.mullarge = sclGetCLSoftwareWithCommon(common_cl, mullarge_cl,"mullarge",hardware,NULL);
-        pd.reduce = sclGetCLSoftwareWithCommon(common_cl, reduce_cl,"reduce",hardware,NULL);
-
-        pd.clearn = sclGetCLSoftware(clearn_cl,"clearn",hardware,NULL);
-        pd.clearresult = sclGetCLSoftware(clearresult_cl,"clearresult",hardware,NULL);        
-        pd.getsegprps = sclGetCLSoftware(getsegprps_cl,"getsegprps",hardware,NULL);
-        pd.finda = sclGetCLSoftware(find_cl,"finda",hardware,NULL);
-        pd.findc = sclGetCLSoftware(find_cl,"findc",hardware,NULL);
-        pd.findu = sclGetCLSoftware(find_cl,"findu",hardware,NULL);
-        pd.clearacu = sclGetCLSoftware(find_cl,"clearacu",hardware,NULL);
-
-	// kernels have __attribute__ ((reqd_work_group_size(256, 1, 1)))
-	// it's still possible the CL complier picked a different size
-	if(pd.getsegprps.local_size[0] != 256){
-		pd.getsegprps.local_size[0] = 256;
-		fprintf(stderr, "Set getsegprps kernel local size to 256\n");
-	}
-	if(pd.mulsmall.local_size[0] != 256){
-		pd.mulsmall.local_size[0] = 256;
-		fprintf(stderr, "Set mulsmall kernel local size to 256\n");
-	}
-	if(pd.mullarge.local_size[0] != 256){
-		pd.mullarge.local_size[0] = 256;
-		fprintf(stderr, "Set mullarge kernel local size to 256\n");
-	}
-	// local size is 1024 for nvidia, 256 for all others
-	if(sd.nvidia){
-		if(pd.reduce.local_size[0] != 1024){		// cl compiler picks 256!
-			pd.reduce.local_size[0] = 1024;
-		}
-		sclSetGlobalSize( pd.reduce, 1024 );
-		
-		if(pd.iterate.local_size[0] != 1024){		// cl compiler picks 256!
-			pd.iterate.local_size[0] = 1024;
-		}
-		sclSetGlobalSize( pd.iterate, 1024 );		
-	}
-	else{
-		if(pd.reduce.local_size[0] != 256){
-			pd.reduce.local_size[0] = 256;
-			fprintf(stderr, "Set reduce kernel local size to 256\n");
-		}
-		sclSetGlobalSize( pd.reduce, 256 );
-		
-		if(pd.iterate.local_size[0] != 256){
-			pd.iterate.local_size[0] = 256;
-			fprintf(stderr, "Set iterate kernel local size to 256\n");
-		}
-		sclSetGlobalSize( pd.iterate, 256 );				
-	}	
+	// build all kernels as one program on a separate thread
+	// this overlaps test prime generation and the checkpoint read
+	const char * sources[] = { common_cl, setup_cl, iterate_cl, mulsmall_cl, mullarge_cl, clearn_cl, clearresult_cl, getsegprps_cl, find_cl };
+	cl_program program = NULL;
+	char options[128];
+	snprintf(options, sizeof(options), "-DLSIZE=%u -DSIEVECOUNT=%u%s", sd.lsize, (uint32_t)sievecount, subgroupOption(hardware, sd));
+	std::thread builder( [&program, &sources, &options, hardware]{ program = sclGetCLProgram(sources, 9, hardware, options); } );
 
 	// setup primes to test
 	size_t tpsize;
@@ -1540,9 +2421,9 @@ void cl_wilson( sclHard hardware, searchData & sd, workStatus & st ){
 		fprintf(stderr,"malloc error, testPrime array\n");
 		exit(EXIT_FAILURE);
 	}
-	residues = (cl_ulong2 *)malloc(st.tpcount * sizeof(cl_ulong2));
+	residues = (cl_ulong2 *)sclAllocPinned(hardware, st.tpcount * sizeof(cl_ulong2), &pd.h_residues);
 	if( residues == NULL ){
-		fprintf(stderr,"malloc error, residue array\n");
+		fprintf(stderr,"pinned alloc error, residue array\n");
 		exit(EXIT_FAILURE);
 	}
 
@@ -1594,83 +2475,213 @@ void cl_wilson( sclHard hardware, searchData & sd, workStatus & st ){
 	fprintf(stderr, "Testing %u primes.  There are %u type 0 (1 mod 3) primes, %u type 1 (5 mod 12) primes, and %u type 2 (11 mod 12) primes\n",
 		st.tpcount,sd.tpcnt[0],sd.tpcnt[1],sd.tpcnt[2]);
 
+	int rsr = 0;
+	if( !sd.test && !sd.tune ){
+		rsr = read_state(sd, st, residues);
+	}
+
+	builder.join();
+
+	if( rsr == 2 ){
+		// trying to resume a finished workunit
+		if(boinc_is_standalone()){
+			printf("Workunit complete.\n");
+		}
+		fprintf(stderr,"Workunit complete.\n");
+		boinc_finish(EXIT_SUCCESS);
+	}
+
+	// create kernels, each holds a reference to the program
+        pd.setup = sclGetCLSoftwareFromProgram(program,"setup",hardware);
+        pd.iterate = sclGetCLSoftwareFromProgram(program,"iterate",hardware);
+        pd.mulsmall = sclGetCLSoftwareFromProgram(program,"mulsmall",hardware);
+        pd.mullarge[0] = sclGetCLSoftwareFromProgram(program,"mullarge",hardware);
+        pd.mullarge[1] = sclGetCLSoftwareFromProgram(program,"mullarge_pow",hardware);
+        pd.mullarge[2] = sclGetCLSoftwareFromProgram(program,"mullarge_bound",hardware);
+        pd.mullarge[3] = sclGetCLSoftwareFromProgram(program,"mullarge_pow_bound",hardware);
+        pd.clearn = sclGetCLSoftwareFromProgram(program,"clearn",hardware);
+        pd.clearresult = sclGetCLSoftwareFromProgram(program,"clearresult",hardware);
+        pd.getsegprps = sclGetCLSoftwareFromProgram(program,"getsegprps",hardware);
+        pd.getsmprimes = sclGetCLSoftwareFromProgram(program,"getsmprimes",hardware);
+        pd.finda = sclGetCLSoftwareFromProgram(program,"finda",hardware);
+        pd.findc = sclGetCLSoftwareFromProgram(program,"findc",hardware);
+        pd.findu = sclGetCLSoftwareFromProgram(program,"findu",hardware);
+        pd.clearacu = sclGetCLSoftwareFromProgram(program,"clearacu",hardware);
+	clReleaseProgram(program);
+
+	// kernels have __attribute__ ((reqd_work_group_size(256, 1, 1)))
+	// it's still possible the CL complier picked a different size
+	if(pd.getsegprps.local_size[0] != 256){
+		pd.getsegprps.local_size[0] = 256;
+		fprintf(stderr, "Set getsegprps kernel local size to 256\n");
+	}
+	if(pd.getsmprimes.local_size[0] != 256){
+		pd.getsmprimes.local_size[0] = 256;
+		fprintf(stderr, "Set getsmprimes kernel local size to 256\n");
+	}
+	if(pd.mulsmall.local_size[0] != 256){
+		pd.mulsmall.local_size[0] = 256;
+		fprintf(stderr, "Set mulsmall kernel local size to 256\n");
+	}
+	for(int v=0; v<4; ++v){
+		if(pd.mullarge[v].local_size[0] != 256){
+			pd.mullarge[v].local_size[0] = 256;
+			fprintf(stderr, "Set %s kernel local size to 256\n", pd.mullarge[v].kernelName);
+		}
+	}
+	// iterate local size is LSIZE, 1024 for nvidia, 256 for all others unless tuned
+	if(pd.iterate.local_size[0] != sd.lsize){		// nvidia cl compiler picks 256!
+		pd.iterate.local_size[0] = sd.lsize;
+		fprintf(stderr, "Set iterate kernel local size to %u\n", sd.lsize);
+	}
+
 	pd.d_testprime = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, st.tpcount*sizeof(cl_ulong), NULL, &err );
 	if ( err != CL_SUCCESS ) {
 		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
 		printf( "ERROR: clCreateBuffer failure.\n" );
 		exit(EXIT_FAILURE);
 	}
-	pd.d_testprimedata = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, st.tpcount*sizeof(cl_ulong8), NULL, &err );
+	// test prime constants, p and q are hot, one, r2 and the targets are cold
+	pd.d_tppq = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, st.tpcount*sizeof(cl_ulong2), NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+		printf( "ERROR: clCreateBuffer failure.\n" );
+		exit(EXIT_FAILURE);
+	}
+	pd.d_tpconst = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, st.tpcount*sizeof(cl_ulong4), NULL, &err );
 	if ( err != CL_SUCCESS ) {
 		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
 		printf( "ERROR: clCreateBuffer failure.\n" );
 		exit(EXIT_FAILURE);
 	}
+	// read back with non-blocking copies, a mapped buffer would stall the mul kernels that write it
 	pd.d_residues = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, st.tpcount*sizeof(cl_ulong2), NULL, &err );
 	if ( err != CL_SUCCESS ) {
 		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
 		printf( "ERROR: clCreateBuffer failure.\n" );
 		exit(EXIT_FAILURE);
 	}
+	pd.d_tpindex = clCreateBuffer( hardware.context, CL_MEM_READ_ONLY, st.tpcount*sizeof(cl_uint), NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure.\n");
+		printf( "ERROR: clCreateBuffer failure.\n" );
+		exit(EXIT_FAILURE);
+	}
 
 	// send test primes to gpu, blocking
 	sclWrite(hardware, st.tpcount * sizeof(cl_ulong), pd.d_testprime, tplist);
 	free(tplist);
 
+	// test prime indexes grouped by type, so a batch of one type is a contiguous range for the mul kernels
+	uint32_t tpoffset[3] = { 0, sd.tpcnt[0], sd.tpcnt[0]+sd.tpcnt[1] };
+	uint32_t * h_tpindex = (uint32_t *)malloc(st.tpcount * sizeof(uint32_t));
+	if( h_tpindex == NULL ){
+		fprintf(stderr,"malloc error, h_tpindex\n");
+		exit(EXIT_FAILURE);
+	}
+	uint32_t tpfill[3] = { tpoffset[0], tpoffset[1], tpoffset[2] };
+	for(uint32_t i=0; i<st.tpcount; ++i){
+		h_tpindex[tpfill[tp[i].type]++] = i;
+	}
+	sclWrite(hardware, st.tpcount * sizeof(cl_uint), pd.d_tpindex, h_tpindex);
+	free(h_tpindex);
+
 	// kernel used in profileGPU, setup arg
-	sclSetKernelArg(pd.clearresult, 0, sizeof(cl_mem), &pd.d_primecount);
-	sclSetKernelArg(pd.clearresult, 1, sizeof(cl_mem), &pd.d_totalcount);
+	sclSetKernelArg(pd.clearresult, 0, sizeof(cl_mem), &pd.d_primecount[0]);
+	sclSetKernelArg(pd.clearresult, 1, sizeof(cl_mem), &pd.d_primecount[1]);
+	sclSetKernelArg(pd.clearresult, 2, sizeof(cl_mem), &pd.d_totalcount);
 	sclSetGlobalSize( pd.clearresult, 1 );
 
-	profileGPU(pd,sd,hardware);
+	profileGPU(pd,sd,st,hardware);
 	
-	sclSetGlobalSize( pd.mulsmall, sd.psize/4 );
-	sclSetGlobalSize( pd.mullarge, sd.psize/4 );
+	// numgroups and numgroups32 are from the memory plan
+	// mullarge is persistent, its groups take the segment's numgroups parts per test prime from a queue
+	sclSetGlobalSize( pd.mulsmall, sd.numgroups32*256 );
+	setMulLargeSize(pd, sd, st);
 
 //	printf("global size for mul %" PRIu64 "\n",pd.mulsmall.global_size[0]);
-
-	sd.numgroups = pd.mulsmall.global_size[0]/256;
-	
 //	printf("numgroups %u\n",sd.numgroups);	
 
+	// number of test primes per mulsmall launch, limited by group total memory shared by the lanes
+	sd.batch = sd.grpbuffer / (sd.lanes * sd.numgroups32 * sizeof(cl_ulong2));
+	if(sd.batch > sd.maxbatch) sd.batch = sd.maxbatch;
+	if(sd.batch == 0) sd.batch = 1;
+
+	// mullarge keeps lane 0's group totals as a ring of slots, one per test prime in flight
+	// the other lanes only run mulsmall batches, so a run starting above 2^32 gives lane 0 the whole buffer
+	const uint32_t mullanes = (st.currp < 0xFFFFFFFF) ? sd.lanes : 1;
+	sd.slots = sd.grpbuffer / (mullanes * sd.numgroups * sizeof(cl_ulong2));
+	if(sd.slots > RINGSLOTS) sd.slots = RINGSLOTS;
+	if(sd.slots == 0) sd.slots = 1;
+	pd.grpcap = std::max((uint64_t)sd.slots * sd.numgroups, (uint64_t)sd.batch * sd.numgroups32) * sizeof(cl_ulong2);
+
 	sclSetGlobalSize( pd.getsegprps, sd.range/60+1 );
 
 //	printf("getsegprps gs %" PRIu64"\n",pd.getsegprps.global_size[0]);
 	
-	const uint32_t itersize = 2560000;
-	sclSetGlobalSize( pd.iterate, itersize );
-	const uint32_t itergroups = (sd.nvidia) ? pd.iterate.global_size[0]/1024 : pd.iterate.global_size[0]/256;	
+	sclSetGlobalSize( pd.iterate, sd.itersize );
+	const uint32_t itergroups = pd.iterate.global_size[0]/sd.lsize;
 	
 	sclSetGlobalSize( pd.clearn, 1 );
 	sclSetGlobalSize( pd.clearacu, 1 );
 	
-	const uint32_t stride = 256000;
-	sclSetGlobalSize( pd.setup, stride );
-	sclSetGlobalSize( pd.finda, stride );
-	sclSetGlobalSize( pd.findc, stride );
-	sclSetGlobalSize( pd.findu, stride );
+	sclSetGlobalSize( pd.setup, sd.stride );
+	sclSetGlobalSize( pd.finda, sd.stride );
+	sclSetGlobalSize( pd.findc, sd.stride );
+	sclSetGlobalSize( pd.findu, sd.stride );
 
-	pd.d_primes = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, sd.psize*sizeof(cl_ulong), NULL, &err);
-        if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure d_primes\n");
-                printf( "ERROR: clCreateBuffer failure d_primes\n" );
+	// two prp buffer sets, one is generated while the other is multiplied
+	// the memory plan uses one set without prefetching on small devices
+	allocSegmentBuffers(pd, sd, 0);
+	if(sd.bufsets == 2){
+		allocSegmentBuffers(pd, sd, 1);
+	}
+	if(st.currp < 0xFFFFFFFF){
+		for(uint32_t s=0; s<sd.bufsets; ++s){
+			allocPowerBuffers(pd, sd, s);
+		}
+	}
+
+	// mul kernels reset each slot's ticket after folding, so this is only cleared once
+	// lane 0's tickets and the slot use counts cover every mullarge slot
+	uint32_t * h_ticket = (uint32_t *)calloc(RINGSLOTS, sizeof(uint32_t));
+	if( h_ticket == NULL ){
+		fprintf(stderr,"malloc error, h_ticket\n");
 		exit(EXIT_FAILURE);
 	}
-	for(int i=0; i<3; ++i){
-		pd.d_powers[i] = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, sd.psize*sizeof(cl_uint2), NULL, &err);
+	for(uint32_t l=0; l<mullanes; ++l){
+		const uint64_t grpbytes = (l == 0) ? pd.grpcap : (uint64_t)sd.batch * sd.numgroups32 * sizeof(cl_ulong2);
+		const uint32_t tickets = (l == 0) ? RINGSLOTS : sd.batch;
+		pd.d_grptotal[l] = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, grpbytes, NULL, &err);
 		if ( err != CL_SUCCESS ) {
-			fprintf(stderr, "ERROR: clCreateBuffer failure d_powers\n");
-			printf( "ERROR: clCreateBuffer failure d_powers\n" );
+			fprintf(stderr, "ERROR: clCreateBuffer failure d_grptotal\n");
+			printf( "ERROR: clCreateBuffer failure d_grptotal\n" );
+			exit(EXIT_FAILURE);
+		}
+		pd.d_ticket[l] = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, tickets*sizeof(cl_uint), NULL, &err);
+		if ( err != CL_SUCCESS ) {
+			fprintf(stderr, "ERROR: clCreateBuffer failure d_ticket\n");
+			printf( "ERROR: clCreateBuffer failure d_ticket\n" );
 			exit(EXIT_FAILURE);
 		}
+		sclWrite(hardware, tickets * sizeof(cl_uint), pd.d_ticket[l], h_ticket);
 	}
-
-	pd.d_grptotal = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, sd.numgroups*sizeof(cl_ulong2), NULL, &err);
+	// mullarge work queue head and exit count, and the fold count of each slot, reset by the kernel
+	pd.d_queue = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, 2*sizeof(cl_uint), NULL, &err);
 	if ( err != CL_SUCCESS ) {
-		fprintf(stderr, "ERROR: clCreateBuffer failure d_grptotal\n");
-		printf( "ERROR: clCreateBuffer failure d_grptotal\n" );
+		fprintf(stderr, "ERROR: clCreateBuffer failure d_queue\n");
+		printf( "ERROR: clCreateBuffer failure d_queue\n" );
 		exit(EXIT_FAILURE);
 	}
+	sclWrite(hardware, 2 * sizeof(cl_uint), pd.d_queue, h_ticket);
+	pd.d_slotuse = clCreateBuffer(hardware.context, CL_MEM_READ_WRITE, RINGSLOTS*sizeof(cl_uint), NULL, &err);
+	if ( err != CL_SUCCESS ) {
+		fprintf(stderr, "ERROR: clCreateBuffer failure d_slotuse\n");
+		printf( "ERROR: clCreateBuffer failure d_slotuse\n" );
+		exit(EXIT_FAILURE);
+	}
+	sclWrite(hardware, RINGSLOTS * sizeof(cl_uint), pd.d_slotuse, h_ticket);
+	free(h_ticket);
 
 	pd.d_found = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err );
 	if ( err != CL_SUCCESS ) {
@@ -1686,20 +2697,16 @@ void cl_wilson( sclHard hardware, searchData & sd, workStatus & st ){
 	}
 	
 	// set static kernel args
-	sclSetKernelArg(pd.clearn, 0, sizeof(cl_mem), &pd.d_primecount);
 	sclSetKernelArg(pd.clearn, 1, sizeof(cl_mem), &pd.d_totalcount);	
 		
-	sclSetKernelArg(pd.getsegprps, 3, sizeof(cl_mem), &pd.d_primes);
-	sclSetKernelArg(pd.getsegprps, 4, sizeof(cl_mem), &pd.d_primecount);
-	sclSetKernelArg(pd.getsegprps, 5, sizeof(cl_mem), &pd.d_powers[0]);
-	sclSetKernelArg(pd.getsegprps, 6, sizeof(cl_mem), &pd.d_powers[1]);
-	sclSetKernelArg(pd.getsegprps, 7, sizeof(cl_mem), &pd.d_powers[2]);
-	sclSetKernelArg(pd.getsegprps, 8, sizeof(uint64_t), &sd.typeTarget[0]);
-	sclSetKernelArg(pd.getsegprps, 9, sizeof(uint64_t), &sd.typeTarget[1]);
-	sclSetKernelArg(pd.getsegprps, 10, sizeof(uint64_t), &sd.typeTarget[2]);
-	sclSetKernelArg(pd.getsegprps, 11, sizeof(uint64_t), &sd.powerLimit[0]);
-	sclSetKernelArg(pd.getsegprps, 12, sizeof(uint64_t), &sd.powerLimit[1]);
-	sclSetKernelArg(pd.getsegprps, 13, sizeof(uint64_t), &sd.powerLimit[2]);
+	uint32_t offsets = sd.offsets;
+	sclSetKernelArg(pd.getsegprps, 5, sizeof(cl_mem), &pd.d_sieveprime);
+	sclSetKernelArg(pd.getsegprps, 7, sizeof(uint32_t), &offsets);
+
+	sclSetKernelArg(pd.getsmprimes, 9, sizeof(uint64_t), &sd.typeTarget[0]);
+	sclSetKernelArg(pd.getsmprimes, 10, sizeof(uint64_t), &sd.typeTarget[1]);
+	sclSetKernelArg(pd.getsmprimes, 11, sizeof(uint64_t), &sd.typeTarget[2]);
+	sclSetKernelArg(pd.getsmprimes, 12, sizeof(cl_mem), &pd.d_sieveprime);
 
 	sclSetKernelArg(pd.clearacu, 0, sizeof(cl_mem), &pd.d_found);
 
@@ -1712,18 +2719,24 @@ void cl_wilson( sclHard hardware, searchData & sd, workStatus & st ){
 	sclSetKernelArg(pd.findu, 0, sizeof(cl_mem), &pd.d_found);
 	sclSetKernelArg(pd.findu, 1, sizeof(cl_mem), &pd.d_acu);
 
-	sclSetKernelArg(pd.reduce, 0, sizeof(cl_mem), &pd.d_testprimedata);
-	sclSetKernelArg(pd.reduce, 1, sizeof(cl_mem), &pd.d_residues);
-	sclSetKernelArg(pd.reduce, 2, sizeof(cl_mem), &pd.d_grptotal);
-	sclSetKernelArg(pd.reduce, 4, sizeof(uint32_t), &sd.numgroups);
-	
-	sclSetKernelArg(pd.mulsmall, 0, sizeof(cl_mem), &pd.d_testprimedata);
-	sclSetKernelArg(pd.mulsmall, 3, sizeof(cl_mem), &pd.d_grptotal);	
-
-	sclSetKernelArg(pd.mullarge, 0, sizeof(cl_mem), &pd.d_testprimedata);
-	sclSetKernelArg(pd.mullarge, 1, sizeof(cl_mem), &pd.d_primes);
-	sclSetKernelArg(pd.mullarge, 2, sizeof(cl_mem), &pd.d_primecount);
-	sclSetKernelArg(pd.mullarge, 4, sizeof(cl_mem), &pd.d_grptotal);
+	sclSetKernelArg(pd.mulsmall, 0, sizeof(cl_mem), &pd.d_tppq);
+	sclSetKernelArg(pd.mulsmall, 1, sizeof(cl_mem), &pd.d_tpconst);
+	sclSetKernelArg(pd.mulsmall, 2, sizeof(cl_mem), &pd.d_tpindex);
+	sclSetKernelArg(pd.mulsmall, 8, sizeof(cl_mem), &pd.d_residues);
+
+	for(int v=0; v<4; ++v){
+		sclSetKernelArg(pd.mullarge[v], 0, sizeof(cl_mem), &pd.d_tppq);
+		sclSetKernelArg(pd.mullarge[v], 1, sizeof(cl_mem), &pd.d_tpconst);
+		sclSetKernelArg(pd.mullarge[v], 2, sizeof(cl_mem), &pd.d_tpindex);
+		sclSetKernelArg(pd.mullarge[v], 5, sizeof(cl_mem), &pd.d_grptotal[0]);
+		sclSetKernelArg(pd.mullarge[v], 6, sizeof(cl_mem), &pd.d_ticket[0]);
+		sclSetKernelArg(pd.mullarge[v], 7, sizeof(cl_mem), &pd.d_residues);
+		sclSetKernelArg(pd.mullarge[v], 8, sizeof(cl_mem), &pd.d_slotuse);
+		sclSetKernelArg(pd.mullarge[v], 13, sizeof(uint32_t), &sd.numgroups);
+		sclSetKernelArg(pd.mullarge[v], 14, sizeof(cl_mem), &pd.d_queue);
+		sclSetKernelArg(pd.mullarge[v], 16, sizeof(uint32_t), &offsets);
+		sclSetKernelArg(pd.mullarge[v], 17, sizeof(uint32_t), &sd.slots);
+	}
 
 	sd.maxtarget = sd.typeTarget[2];
 	if(sd.maxtarget < sd.typeTarget[1]) sd.maxtarget = sd.typeTarget[1];
@@ -1731,7 +2744,15 @@ void cl_wilson( sclHard hardware, searchData & sd, workStatus & st ){
 
 	uint32_t resume = 0;
 
-	if( sd.test ){
+	if( sd.tune ){
+		// timed tuning run, results and checkpoints are not written
+		// start above 2^32 so the time is spent in the device prp generator and mullarge
+		// a small run starts at the beginning and times getsmprimes and mulsmall up to 2^32
+		if(!sd.tunesmall){
+			st.currp = 0x100000000ULL;
+		}
+	}
+	else if( sd.test ){
 		// clear result file
 		FILE * temp_file = my_fopen(RESULT_FILENAME,"w");
 		if (temp_file == NULL){
@@ -1741,17 +2762,8 @@ void cl_wilson( sclHard hardware, searchData & sd, workStatus & st ){
 		fclose(temp_file);
 	}
 	else{
-		int rsr = read_state(sd, st, residues);
-
-		if( rsr == 2 ){
-			// trying to resume a finished workunit
-			if(boinc_is_standalone()){
-				printf("Workunit complete.\n");
-			}
-			fprintf(stderr,"Workunit complete.\n");
-			boinc_finish(EXIT_SUCCESS);
-		}
-		else if( rsr == 1 ){
+		// checkpoint was read during the kernel build
+		if( rsr == 1 ){
 			// resuming
 			if(boinc_is_standalone()){
 				printf("Resuming search from checkpoint. Current P: %" PRIu64 "\n", st.currp);
@@ -1776,72 +2788,30 @@ void cl_wilson( sclHard hardware, searchData & sd, workStatus & st ){
 		}
 	}
 	
-	// for small prime generation on cpu
-	bool freed = true;	
-	primesieve_iterator it;
-	uint64_t * smprime = NULL;
-	cl_ulong2 * smpower = NULL;
-	cl_ulong * h_prime = NULL;
-	cl_ulong2 * h_power = NULL;
-	
-	if(st.currp < 0xFFFFFFFF){
-		freed = false;
-		primesieve_init(&it);
-		primesieve_jump_to(&it, st.currp, 0xFFFFFFFF);
-		
-		// beginning 32 bit host prime and power tables
-		smprime = (uint64_t *)malloc(sd.psize*sizeof(uint64_t));
-		if( smprime == NULL ){
-			fprintf(stderr,"malloc error: smprime\n");
-			exit(EXIT_FAILURE);
-		}
-		smpower = (cl_ulong2 *)malloc(sd.psize*sizeof(cl_ulong2));
-		if( smpower == NULL ){
-			fprintf(stderr,"malloc error: smpower\n");
-			exit(EXIT_FAILURE);
-		}
-		// compressed 32 bit host prime and power tables
-		h_prime = (cl_ulong *)malloc(sd.psize*sizeof(cl_ulong));
-		if( h_prime == NULL ){
-			fprintf(stderr,"malloc error: h_prime\n");
-			exit(EXIT_FAILURE);
-		}
-		h_power = (cl_ulong2 *)malloc(sd.psize*sizeof(cl_ulong2));
-		if( h_power == NULL ){
-			fprintf(stderr,"malloc error: h_power\n");
-			exit(EXIT_FAILURE);
-		}
-		// device 32 bit prime and power tables
-		for(int i=0; i<3; ++i){
-			pd.d_primes32[i] = clCreateBuffer(hardware.context, CL_MEM_READ_ONLY, sd.psize*sizeof(cl_ulong), NULL, &err);
-			if ( err != CL_SUCCESS ) {
-				fprintf(stderr, "ERROR: clCreateBuffer failure d_primes32\n");
-				printf( "ERROR: clCreateBuffer failure d_primes\n" );
-				exit(EXIT_FAILURE);
-			}		
-			pd.d_powers32[i] = clCreateBuffer(hardware.context, CL_MEM_READ_ONLY, sd.psize*sizeof(cl_ulong2), NULL, &err);
-			if ( err != CL_SUCCESS ) {
-				fprintf(stderr, "ERROR: clCreateBuffer failure d_powers32\n");
-				printf( "ERROR: clCreateBuffer failure d_powers\n" );
-				exit(EXIT_FAILURE);
-			}
-		}		
-	}	
-
-	sclEnqueueKernel(hardware, pd.clearresult);
+	clearPrimeCounts(pd, hardware);
 
 	// setup test prime constants
 	sclSetKernelArg(pd.setup, 0, sizeof(cl_mem), &pd.d_testprime);
-	sclSetKernelArg(pd.setup, 1, sizeof(cl_mem), &pd.d_testprimedata);
-	sclSetKernelArg(pd.setup, 2, sizeof(uint32_t), &st.tpcount);
-	sclSetKernelArg(pd.setup, 3, sizeof(uint64_t), &sd.typeTarget[0]);
-	sclSetKernelArg(pd.setup, 4, sizeof(uint64_t), &sd.typeTarget[1]);
-	sclSetKernelArg(pd.setup, 5, sizeof(uint64_t), &sd.typeTarget[2]);
-	sclSetKernelArg(pd.setup, 6, sizeof(cl_mem), &pd.d_residues);
-	sclSetKernelArg(pd.setup, 7, sizeof(uint32_t), &resume);
-	sclEnqueueKernel(hardware, pd.setup);
+	sclSetKernelArg(pd.setup, 1, sizeof(cl_mem), &pd.d_tppq);
+	sclSetKernelArg(pd.setup, 2, sizeof(cl_mem), &pd.d_tpconst);
+	sclSetKernelArg(pd.setup, 3, sizeof(uint32_t), &st.tpcount);
+	sclSetKernelArg(pd.setup, 4, sizeof(cl_mem), &pd.d_residues);
+	sclSetKernelArg(pd.setup, 5, sizeof(uint32_t), &resume);
+	if(sd.tune){
+		sclFinish(hardware);
+		auto setupstart = std::chrono::steady_clock::now();
+		sclEnqueueKernel(hardware, pd.setup);
+		sclFinish(hardware);
+		sd.tunesetup = std::chrono::duration<double>(std::chrono::steady_clock::now() - setupstart).count();
+	}
+	else{
+		sclEnqueueKernel(hardware, pd.setup);
+	}
 	sclReleaseMemObject(pd.d_testprime);
 
+	// mul launches on the other lanes start after the setup kernel
+	forkLanes(pd, sd, hardware);
+
 	time(&boinc_last);
 	time(&ckpt_last);
 	time_t totals, totalf;
@@ -1849,106 +2819,225 @@ void cl_wilson( sclHard hardware, searchData & sd, workStatus & st ){
 		time(&totals);
 	}
 	uint32_t kernelq = 0;
-	cl_event launchEvent = NULL;
-	uint32_t maxq = 100;
+	uint32_t set = 0;
+	uint64_t prefetched = 0;
+	// every segment above 2^32 is timed once the throttle waits show it's done, at most 2 groups of maxq are pending
+	segmentTimer timer = {};
+	timer.pending = (segmentSample *)malloc(2 * sd.maxq * sizeof(segmentSample));
+	if( timer.pending == NULL ){
+		fprintf(stderr,"malloc error, segment samples\n");
+		exit(EXIT_FAILURE);
+	}
+	const uint64_t tunefirst = st.currp;
+	auto tunestart = std::chrono::steady_clock::now();
+
+	// the residue array holds checkpoint snapshots until the iterate stage reads back the final residues
+	checkpointWriter cw;
+	cw.residues = residues;
+	cw.ready = NULL;
+	cw.pending = false;
+	cw.written = false;
+	cw.quit = false;
+	if(!sd.tune){
+		cw.thread = std::thread(checkpointWriterLoop, std::ref(cw), std::ref(sd));
+	}
+
+	// the result worker loads its files now and waits for the iterate stage
+	resultWorker rw;
+	rw.batches = 0;
+	rw.avail = 0;
+	rw.next = 0;
+	rw.committed = 0;
+	rw.ready = (cl_event *)malloc(st.tpcount * sizeof(cl_event));
+	rw.tpend = (uint32_t *)malloc(st.tpcount * sizeof(uint32_t));
+	rw.result = (wilsonResult *)malloc(st.tpcount * sizeof(wilsonResult));
+	rw.finished = (bool *)calloc(st.tpcount, sizeof(bool));
+	if( rw.ready == NULL || rw.tpend == NULL || rw.result == NULL || rw.finished == NULL ){
+		fprintf(stderr,"malloc error, result worker\n");
+		exit(EXIT_FAILURE);
+	}
+	if(!sd.tune){
+		rw.thread = std::thread(resultWorkerLoop, std::ref(rw), std::ref(pd), std::ref(sd), std::ref(st), tp, residues);
+	}
 
 	// main search loop
 	while(st.currp <= sd.maxtarget){
 
-		// free memory after primes < 2^32 are completed
-		if(!freed && st.currp > 0xFFFFFFFF){
-			freed = true;
-			primesieve_free_iterator(&it);
-			free(smprime);
-			free(smpower);
-			free(h_prime);
-			free(h_power);
-			for(int i=0; i<3; ++i){
-				sclReleaseMemObject(pd.d_powers32[i]);
-				sclReleaseMemObject(pd.d_primes32[i]);
-			}			
+		// tuning runs stop after a fixed time, small runs at 2^32
+		if(sd.tune && std::chrono::duration<double>(std::chrono::steady_clock::now() - tunestart).count() > sd.tunesecs){
+			break;
+		}
+		if(sd.tune && sd.tunesmall && st.currp > 0xFFFFFFFF){
+			break;
 		}
 
 		time(&time_curr);
 		int ckpt_time = (int)time_curr - (int)ckpt_last;
-		if( ckpt_time > 60 ){
+		if( !sd.tune ){
+			collectCheckpoint(sd, cw);
+		}
+		if( !sd.tune && ckpt_time > 60 ){
 			ckpt_last = time_curr;
 			getFractionDone(sd, st, 0);				
-			// 1 minute checkpoint
-			if(kernelq > 0){
-				waitOnEvent(hardware, launchEvent);
-				kernelq = 0;
-			}
-			boinc_begin_critical_section();
-			getDataFromGPU(pd, sd, hardware, st, residues, h_primecount);
-			checkpoint(sd, st, residues, ckpt_time);
-			boinc_end_critical_section();
-			// clear counters
-			sclEnqueueKernel(hardware, pd.clearresult);
+			// 1 minute checkpoint, the device keeps running while the snapshot is written
+			snapshotState(pd, sd, st, hardware, cw, ckpt_time);
 		}
 
-		uint64_t stop = getPrimes(hardware, pd, sd, st, smprime, smpower, h_prime, h_power, it);
+		uint64_t stop = getPrimes(pd, sd, st, set, prefetched);
 		double chunksize = (double)(stop - st.currp);
 
-		// group prime types for cache and multiply
-		uint32_t tpcnt = 0;
-		for(uint32_t j=0; j<3; ++j){
-			for(uint32_t i=0; i<st.tpcount; ++i){
-				if(tp[i].type != j)
-					continue;
-				++tpcnt;
-				if(st.currp > sd.typeTarget[j])
+		// counts a launch, every maxq launches the cpu sleeps until the lanes reach the previous throttle markers
+		// tpcnt test primes of the segment are queued for the fraction done
+		auto queued = [&](uint32_t tpcnt){
+			if(++kernelq == sd.maxq){
+				time(&time_curr);
+				if( ((int)time_curr - (int)boinc_last) > 3 ){
+					boinc_last = time_curr;
+					// update BOINC fraction done every 4 sec
+					double partialDone = (double)tpcnt / (double)st.tpcount * chunksize;
+					getFractionDone(sd, st, partialDone);
+				}				
+				throttleLanes(pd, sd, false);
+				kernelq = 0;
+				sampleSegments(sd, timer);
+			}
+		};
+
+		if(st.currp < 0xFFFFFFFF){
+			// multiply each type's test primes in batches, one mulsmall launch per batch
+			uint32_t tpcnt = 0;
+			for(uint32_t j=0; j<3; ++j){
+				if(st.currp > sd.typeTarget[j]){
+					tpcnt += sd.tpcnt[j];
 					continue;
-				multiply(hardware, pd, sd, st, i, j);
-				sclSetKernelArg(pd.reduce, 3, sizeof(uint32_t), &i);
-				if(kernelq == 0){
-					launchEvent = sclEnqueueKernelEvent(hardware, pd.reduce);
 				}
-				else{
-					sclEnqueueKernel(hardware, pd.reduce);
+				for(uint32_t b=0; b<sd.tpcnt[j]; b+=sd.batch){
+					uint32_t tpstart = tpoffset[j] + b;
+					uint32_t count = std::min(sd.batch, sd.tpcnt[j] - b);
+					uint32_t lane = (j + b / sd.batch) % sd.lanes;
+					tpcnt += count;
+					multiply(pd, tpstart, count, j, set, lane);
+					queued(tpcnt);
 				}
-				if(++kernelq == maxq){
-					time(&time_curr);
-					if( ((int)time_curr - (int)boinc_last) > 3 ){
-						boinc_last = time_curr;
-						// update BOINC fraction done every 4 sec
-						double partialDone = (double)tpcnt / (double)st.tpcount * chunksize;
-						getFractionDone(sd, st, partialDone);
-					}				
-					// limit cl queue depth and sleep cpu
-					waitOnEvent(hardware, launchEvent);
-					kernelq = 0;
-				}				
 			}
 		}
+		else{
+			// one persistent mullarge launch multiplies every active test prime
+			// the lanes wait for the segment's generation, so both are done when the launch is
+			segmentSample & sample = timer.pending[timer.npending++];
+			sample.gen = pd.genDone[set];
+			clRetainEvent(sample.gen);
+			sample.mul = multiplySegment(pd, sd, st, stop, set);
+			sample.range = stop - st.currp;
+			queued(st.tpcount);
+		}
 		
 		// add kernel prp count to total count and clear kernel prp count
-		sclEnqueueKernel(hardware, pd.clearn);	
+		// the buffer set can be reused for generation once this is complete
+		joinLanes(pd, sd, hardware);
+		sclSetKernelArg(pd.clearn, 0, sizeof(cl_mem), &pd.d_primecount[set]);
+		if(pd.mulDone[set] != NULL){
+			clReleaseEvent(pd.mulDone[set]);
+		}
+		pd.mulDone[set] = sclEnqueueKernelEvent(hardware, pd.clearn);
+		if(sd.bufsets == 2){
+			set ^= 1;
+		}
 			
 		st.currp = stop;
+
+		if(st.currp > 0xFFFFFFFF && ++timer.segments == ADAPTSEGS){
+			adaptSegment(pd, sd, st, timer);
+		}
 	}
 
 
-	if(kernelq > 0){
-		waitOnEvent(hardware, launchEvent);
-		kernelq=0;
+	// every lane is done with the search loop's launches
+	throttleLanes(pd, sd, true);
+	kernelq = 0;
+	timer.nmarked = timer.npending;
+	sampleSegments(sd, timer);
+	free(timer.pending);
+
+	// the final checkpoint reuses the residue array
+	stopCheckpointWriter(cw);
+
+	if(sd.tune){
+		// wait for all queued work, including the prefetched segment
+		sclFlush(hardware);
+		sclFinish(pd.gen);
+		sclFinish(hardware);
+		sd.tunerate = (double)(st.currp - tunefirst) / std::chrono::duration<double>(std::chrono::steady_clock::now() - tunestart).count();
+		tunestart = std::chrono::steady_clock::now();
 	}
 
 	// iterate from type target factorial to each prime's target factorial
-	sclSetKernelArg(pd.iterate, 0, sizeof(cl_mem), &pd.d_testprimedata);
-	sclSetKernelArg(pd.iterate, 1, sizeof(cl_mem), &pd.d_residues);	
-	for(uint32_t startTp = 0; startTp < st.tpcount; startTp += itergroups){
-		sclSetKernelArg(pd.iterate, 2, sizeof(uint32_t), &startTp);
-		sclSetKernelArg(pd.iterate, 3, sizeof(uint32_t), &st.tpcount);		
+	// the prp buffers aren't used again, the chunk list takes their place
+	for(uint32_t s=0; s<2; ++s){
+		sclReleaseMemObject(pd.d_primes[s]);
+		pd.d_primes[s] = NULL;
+		for(int i=0; i<3; ++i){
+			sclReleaseMemObject(pd.d_powers[s][i]);
+			pd.d_powers[s][i] = NULL;
+		}
+		pd.pcap[s] = 0;
+	}
+	uint32_t * h_chunktp;
+	uint32_t chunkcount = iterateChunks(pd, sd, st, hardware, tp, h_chunktp);
+	sclSetKernelArg(pd.iterate, 0, sizeof(cl_mem), &pd.d_tppq);
+	sclSetKernelArg(pd.iterate, 1, sizeof(cl_mem), &pd.d_tpconst);
+	sclSetKernelArg(pd.iterate, 2, sizeof(cl_mem), &pd.d_residues);	
+	sclSetKernelArg(pd.iterate, 3, sizeof(cl_mem), &pd.d_chunk);
+	sclSetKernelArg(pd.iterate, 4, sizeof(cl_mem), &pd.d_chunktp);
+	sclSetKernelArg(pd.iterate, 5, sizeof(cl_mem), &pd.d_tpchunks);
+	sclSetKernelArg(pd.iterate, 6, sizeof(cl_mem), &pd.d_chunktotal);
+	sclSetKernelArg(pd.iterate, 7, sizeof(cl_mem), &pd.d_chunkticket);
+
+	// results are written as they are finalized, a restart would write them again
+	if(!sd.tune){
+		if(boinc_is_standalone()) printf("Finalizing results on cpu\n");
+		boinc_begin_critical_section();
+	}
+
+	uint32_t tpread = 0;
+	for(uint32_t startChunk = 0; startChunk < chunkcount; startChunk += itergroups){
+		sclSetKernelArg(pd.iterate, 8, sizeof(uint32_t), &startChunk);
+		sclSetKernelArg(pd.iterate, 9, sizeof(uint32_t), &chunkcount);		
 		sclEnqueueKernel(hardware, pd.iterate);
 //		float kernel_ms = ProfilesclEnqueueKernel(hardware, pd.iterate);
 //		printf("iterate %0.2fms\n",kernel_ms);
-	}
 
-	// finalize results
-	boinc_begin_critical_section();
-	getDataFromGPU(pd, sd, hardware, st, residues, h_primecount);
-	getResults(pd, sd, hardware, st, residues, tp);
+		// chunks are in test prime order, the test primes before the next batch's first chunk are done
+		uint32_t endChunk = startChunk + itergroups;
+		uint32_t tpend = (endChunk >= chunkcount) ? st.tpcount : h_chunktp[endChunk];
+		if(!sd.tune && tpend > tpread){
+			streamResidues(pd, hardware, rw, residues, tpread, tpend);
+			tpread = tpend;
+		}
+	}
+	free(h_chunktp);
+
+	if(sd.tune){
+		sclFinish(hardware);
+		sd.tuneiter = std::chrono::duration<double>(std::chrono::steady_clock::now() - tunestart).count();
+		free(rw.ready);
+		free(rw.tpend);
+		free(rw.result);
+		free(rw.finished);
+		free(tp);
+		sclFreePinned(hardware, pd.h_residues, residues);
+		free(h_primecount);
+		cleanup(pd);
+		return;
+	}
+
+	// the worker has finalized every test prime when it exits
+	rw.thread.join();
+	free(rw.ready);
+	free(rw.tpend);
+	free(rw.result);
+	free(rw.finished);
+	getCountsFromGPU(pd, hardware, st, h_primecount);
 	finalizeResults(sd);
 	st.done = 1;
 	boinc_fraction_done(1.0);
@@ -1967,7 +3056,7 @@ void cl_wilson( sclHard hardware, searchData & sd, workStatus & st ){
 	}
 
 	free(tp);
-	free(residues);
+	sclFreePinned(hardware, pd.h_residues, residues);
 	free(h_primecount);
 	cleanup(pd);
 
@@ -2139,8 +3228,233 @@ void run_test( sclHard hardware, searchData & sd, workStatus & st ){
 }
 
 
+void setDefaultTuning( searchData & sd ){
+	sd.genms = 3.0;
+	sd.muldiv = 4;
+	sd.muldiv32 = 4;
+	sd.maxbatch = MAXBATCH;
+	sd.maxq = 100;
+	sd.lanes = 1;
+	sd.lsize = (sd.nvidia) ? 1024 : 256;
+	sd.itersize = 2560000;
+	sd.stride = 256000;
+}
+
+
+bool validTuning( searchData & sd ){
+	if( sd.genms < 0.1 || sd.genms > 100.0 ) return false;
+	if( sd.muldiv == 0 || sd.muldiv32 == 0 || sd.maxbatch == 0 || sd.maxq == 0 || sd.itersize == 0 || sd.stride == 0 ) return false;
+	if( sd.lanes == 0 || sd.lanes > MAXLANES ) return false;
+	// a batch shares lane 0's tickets with the mullarge slots
+	if( sd.maxbatch > RINGSLOTS ) return false;
+	// LSIZE is a power of 2 for the iterate kernel's reduction
+	if( sd.lsize < 64 || sd.lsize > 1024 || (sd.lsize & (sd.lsize-1)) ) return false;
+	return true;
+}
+
+
+// tuning file has one line per device and driver
+// name<tab>driver<tab>genms muldiv maxbatch maxq lsize itersize stride lanes muldiv32
+// lanes and muldiv32 are missing in files from older versions and keep their defaults
+void loadTuning( searchData & sd, const char * filename, const char * device_name, const char * device_driver ){
+
+	FILE * in = fopen(filename, "r");
+	if(in == NULL){
+		return;
+	}
 
+	char line[4096];
+	while( fgets(line, sizeof(line), in) != NULL ){
+		char * name = strtok(line, "\t");
+		char * driver = strtok(NULL, "\t");
+		char * values = strtok(NULL, "\r\n");
+		if( name == NULL || driver == NULL || values == NULL ) continue;
+		if( strcmp(name, device_name) != 0 || strcmp(driver, device_driver) != 0 ) continue;
 
+		searchData t = sd;
+		if( sscanf(values, "%lf %u %u %u %u %u %u %u %u", &t.genms, &t.muldiv, &t.maxbatch, &t.maxq, &t.lsize, &t.itersize, &t.stride, &t.lanes, &t.muldiv32) >= 7 && validTuning(t) ){
+			sd = t;
+			fprintf(stderr, "Using tuned launch parameters from %s\n", filename);
+			if(boinc_is_standalone()){
+				printf("Using tuned launch parameters from %s\n", filename);
+			}
+		}
+		else{
+			fprintf(stderr, "Ignoring invalid tuning entry in %s\n", filename);
+		}
+		break;
+	}
 
+	fclose(in);
+}
 
 
+// replace this device's line in the tuning file, other devices are kept
+void saveTuning( searchData & sd, const char * filename, const char * device_name, const char * device_driver ){
+
+	char tmpname[1100];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+	FILE * out = fopen(tmpname, "w");
+	if(out == NULL){
+		fprintf(stderr, "Cannot open %s !!!\n", tmpname);
+		printf("Cannot open %s !!!\n", tmpname);
+		return;
+	}
+
+	FILE * in = fopen(filename, "r");
+	if(in != NULL){
+		char line[4096], key[4096];
+		while( fgets(line, sizeof(line), in) != NULL ){
+			snprintf(key, sizeof(key), "%s\t%s\t", device_name, device_driver);
+			if( strncmp(line, key, strlen(key)) != 0 ){
+				fputs(line, out);
+			}
+		}
+		fclose(in);
+	}
+
+	fprintf(out, "%s\t%s\t%.2f %u %u %u %u %u %u %u %u\n", device_name, device_driver,
+		sd.genms, sd.muldiv, sd.maxbatch, sd.maxq, sd.lsize, sd.itersize, sd.stride, sd.lanes, sd.muldiv32);
+
+	if( fclose(out) != 0 ){
+		fprintf(stderr, "Cannot write %s !!!\n", tmpname);
+		printf("Cannot write %s !!!\n", tmpname);
+		remove(tmpname);
+		return;
+	}
+
+	// rename fails on windows if the file exists
+	remove(filename);
+	if( rename(tmpname, filename) != 0 ){
+		fprintf(stderr, "Cannot write %s !!!\n", filename);
+		printf("Cannot write %s !!!\n", filename);
+		remove(tmpname);
+	}
+}
+
+
+enum { TUNE_RATE, TUNE_SMALL, TUNE_BOTH, TUNE_ITERATE, TUNE_SETUP };
+
+// one timed run over the tuning range, higher score is better
+// TUNE_RATE times the search above 2^32, TUNE_SMALL below it, TUNE_BOTH runs both for parameters they share
+double tuneScore( sclHard hardware, searchData & sd, workStatus & st, int metric ){
+
+	if(metric == TUNE_BOTH){
+		return sqrt( tuneScore(hardware, sd, st, TUNE_RATE) * tuneScore(hardware, sd, st, TUNE_SMALL) );
+	}
+
+	st.pmin = 10000000000000ULL;
+	st.pmax = 10000000000000ULL + 1000000;
+
+	sd.tunesmall = (metric == TUNE_SMALL);
+	cl_wilson(hardware, sd, st);
+	resetData(sd, st);
+	sd.tunesmall = false;
+
+	if(metric == TUNE_RATE || metric == TUNE_SMALL){
+		return sd.tunerate;
+	}
+	else if(metric == TUNE_ITERATE){
+		return 1.0 / sd.tuneiter;
+	}
+	return 1.0 / sd.tunesetup;
+}
+
+
+// try each value of one parameter, keeping the others at their best so far
+// a value has to be 2% faster than the current one to replace it, so timing noise doesn't pick a new value
+template <typename T>
+void tuneSweep( sclHard hardware, searchData & sd, workStatus & st, const char * name, T & param, const T * values, int count, int metric ){
+
+	T best = param;
+	double bestscore = tuneScore(hardware, sd, st, metric);
+	printf("%s %g: %g\n", name, (double)param, bestscore);
+
+	for(int i=0; i<count; ++i){
+		if(values[i] == best) continue;
+		param = values[i];
+		double score = tuneScore(hardware, sd, st, metric);
+		printf("%s %g: %g\n", name, (double)param, score);
+		if(score > bestscore * 1.02){
+			bestscore = score;
+			best = param;
+		}
+	}
+
+	param = best;
+	printf("using %s %g\n\n", name, (double)best);
+	fprintf(stderr, "Tuned %s %g\n", name, (double)best);
+}
+
+
+void run_tune( sclHard hardware, searchData & sd, workStatus & st, const char * filename, const char * device_name, const char * device_driver ){
+
+	printf("Tuning launch parameters for %s, this will take a few minutes.\n\n", device_name);
+	fprintf(stderr, "Tuning launch parameters.\n");
+
+	time_t start, finish;
+	time(&start);
+
+	size_t maxwg;
+	cl_int err = clGetDeviceInfo(hardware.device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxwg, NULL);
+	if (err != CL_SUCCESS) {
+		printf( "clGetDeviceInfo failed with %d\n", err );
+		exit(EXIT_FAILURE);
+	}
+	if(sd.lsize > maxwg){
+		sd.lsize = 256;
+	}
+
+	// main search loop parameters, scored by numbers searched per second
+	sd.tunesecs = 3.0;
+
+	// the prp kernel time also sets the profiled segment size, so the compute unit count is only a first guess
+	const double genms[] = { 1.0, 2.0, 3.0, 5.0, 8.0 };
+	tuneSweep(hardware, sd, st, "prp kernel ms", sd.genms, genms, 5, TUNE_RATE);
+
+	const uint32_t muldiv[] = { 1, 2, 4, 8, 16 };
+	tuneSweep(hardware, sd, st, "mul divisor", sd.muldiv, muldiv, 5, TUNE_RATE);
+
+	// mulsmall batches on the lanes only run below 2^32
+	const uint32_t muldiv32[] = { 1, 2, 4, 8, 16 };
+	tuneSweep(hardware, sd, st, "small mul divisor", sd.muldiv32, muldiv32, 5, TUNE_SMALL);
+
+	const uint32_t maxbatch[] = { 4, 16, 64, 128 };
+	tuneSweep(hardware, sd, st, "mul batch", sd.maxbatch, maxbatch, 4, TUNE_SMALL);
+
+	const uint32_t lanes[] = { 1, 2, 4 };
+	tuneSweep(hardware, sd, st, "mul lanes", sd.lanes, lanes, 3, TUNE_SMALL);
+
+	// queued launches are mullarge segments above 2^32 and mulsmall batches below
+	const uint32_t maxq[] = { 25, 50, 100, 200 };
+	tuneSweep(hardware, sd, st, "queue depth", sd.maxq, maxq, 4, TUNE_BOTH);
+
+	// iterate and setup kernels run once, a short main loop is enough
+	sd.tunesecs = 0.5;
+
+	uint32_t lsize[5];
+	int lcount = 0;
+	for(uint32_t l = 64; l <= 1024 && l <= maxwg; l <<= 1){
+		lsize[lcount++] = l;
+	}
+	tuneSweep(hardware, sd, st, "iterate local size", sd.lsize, lsize, lcount, TUNE_ITERATE);
+
+	const uint32_t itersize[] = { 640000, 1280000, 2560000, 5120000 };
+	tuneSweep(hardware, sd, st, "iterate global size", sd.itersize, itersize, 4, TUNE_ITERATE);
+
+	const uint32_t stride[] = { 64000, 128000, 256000, 512000 };
+	tuneSweep(hardware, sd, st, "setup global size", sd.stride, stride, 4, TUNE_SETUP);
+
+	sd.tune = false;
+
+	saveTuning(sd, filename, device_name, device_driver);
+
+	time(&finish);
+	printf("Tuned parameters: prp kernel ms %.2f, mul divisor %u, small mul divisor %u, mul batch %u, queue depth %u, mul lanes %u, iterate local size %u, iterate global size %u, setup global size %u\n",
+		sd.genms, sd.muldiv, sd.muldiv32, sd.maxbatch, sd.maxq, sd.lanes, sd.lsize, sd.itersize, sd.stride);
+	printf("Saved to %s\n", filename);
+	printf("Elapsed time: %d sec.\n", (int)finish - (int)start);
+	fprintf(stderr, "Saved tuned parameters to %s\n", filename);
+
+}
@@ -5,6 +5,9 @@
 #define STATE_FILENAME_A "stateA.ckp"
 #define STATE_FILENAME_B "stateB.ckp"
 #define GOOD_RES_FILENAME "goodWilsonResults.txt"
+#define TUNE_FILENAME "clwilson_tune.txt"
+
+#define MAXLANES 4		// max in-order queues for mul launches
 
 const uint64_t maxp = 0xFFFFFFFFFFFFFFFF / 4;
 
@@ -19,6 +22,12 @@ typedef struct {
 	int32_t v;
 }goodResult;
 
+typedef struct {
+	uint64_t quot;
+	uint64_t rem;
+	uint32_t prps;		// prps divided out of the residue
+}wilsonResult;
+
 typedef struct {
 	uint64_t pmin, pmax, currp, trickle, state_sum, totalcount;
 	uint32_t tpcount, done;
@@ -26,20 +35,40 @@ typedef struct {
 
 typedef struct {
 	double lastp;
+	double genms;
+	double tunesecs;
+	double tunerate;
+	double tuneiter;
+	double tunesetup;
 	uint64_t checksum;
 	uint64_t typeTarget[3];
 	uint64_t powerLimit[3];
 	uint64_t maxtarget;
+	uint64_t range;
+	uint64_t range32;
+	uint64_t grpbuffer;
 	uint64_t testResultPrime;
 	int64_t maxmalloc;
 	int64_t globalmem;
-	uint32_t pcount32[3];
 	uint32_t nstep;
 	uint32_t sstep;
 	uint32_t tpcnt[3];
-	uint32_t range;
 	uint32_t psize;
+	uint32_t psize32;
+	uint32_t maxprps;
+	uint32_t bufsets;
 	uint32_t numgroups;
+	uint32_t numgroups32;
+	uint32_t batch;
+	uint32_t slots;
+	uint32_t maxbatch;
+	uint32_t muldiv;
+	uint32_t muldiv32;
+	uint32_t maxq;
+	uint32_t lanes;
+	uint32_t lsize;
+	uint32_t itersize;
+	uint32_t stride;
 	uint32_t resultcount;
 	uint32_t prpsremoved;
 	uint32_t grescount;
@@ -49,26 +78,72 @@ typedef struct {
 	bool write_state_a_next;
 	bool test;
 	bool resultTest;
+	bool tune;
+	bool tunesmall;
 	bool nvidia;
+	bool offsets;
 }searchData;
 
+typedef struct {
+	cl_event gen;
+	cl_event mul;
+	uint64_t range;
+}segmentSample;
+
+typedef struct {
+	double target;
+	double genms;
+	double mulms;
+	uint32_t gencount;
+	uint32_t mulcount;
+	uint32_t segments;
+	segmentSample *pending;
+	uint32_t npending;
+	uint32_t nmarked;
+}segmentTimer;
+
 typedef struct {
 	cl_mem d_prps;
-	cl_mem d_primecount;
+	cl_mem d_primecount[2];
 	cl_mem d_totalcount;
-	cl_mem d_primes;
-	cl_mem d_powers[3];
-	cl_mem d_primes32[3];
-	cl_mem d_powers32[3];
-	cl_mem d_grptotal;
+	cl_mem d_sieveprime;
+	cl_mem d_primes[2];
+	cl_mem d_powers[2][3];
+	cl_mem d_grptotal[MAXLANES];
+	cl_mem d_ticket[MAXLANES];
+	cl_mem d_queue;
+	cl_mem d_slotuse;
 	cl_mem d_testprime;
-	cl_mem d_testprimedata;
+	cl_mem d_tppq;
+	cl_mem d_tpconst;
+	cl_mem d_chunk;
+	cl_mem d_chunktp;
+	cl_mem d_tpchunks;
+	cl_mem d_chunktotal;
+	cl_mem d_chunkticket;
+	cl_mem d_tpindex;
 	cl_mem d_residues;
+	cl_mem h_residues;
 	cl_mem d_found;
 	cl_mem d_acu;
-	sclSoft iterate, clearn, clearresult, setup, getsegprps, mulsmall, mullarge, reduce, finda, findc, findu, clearacu;
+	cl_event genDone[2];
+	cl_event mulDone[2];
+	cl_event throttle[MAXLANES];
+	uint64_t segbase[2];
+	uint32_t pcap[2];
+	uint64_t grpcap;
+	sclHard gen;
+	sclHard lane[MAXLANES];
+	sclSoft iterate, clearn, clearresult, setup, getsegprps, getsmprimes, mulsmall, finda, findc, findu, clearacu;
+	sclSoft mullarge[4];	// variants, bit 0 segment has powers, bit 1 segment is past the type target
 }progData;
 
 void cl_wilson( sclHard hardware, searchData & sd, workStatus & st );
 
 void run_test( sclHard hardware, searchData & sd, workStatus & st );
+
+void setDefaultTuning( searchData & sd );
+
+void loadTuning( searchData & sd, const char * filename, const char * device_name, const char * device_driver );
+
+void run_tune( sclHard hardware, searchData & sd, workStatus & st, const char * filename, const char * device_name, const char * device_driver );
@@ -6,11 +6,49 @@
 */
 
 
-// using largest local size for reduction kernels
-#ifdef __NV_CL_C_VERSION
-	#define LSIZE 1024
+// local size for reduction kernels, normally set by the host with -DLSIZE
+#ifndef LSIZE
+	#ifdef __NV_CL_C_VERSION
+		#define LSIZE 1024
+	#else
+		#define LSIZE 256
+	#endif
+#endif
+
+// orders a work item's global accesses for other workgroups, a release before a ticket atomic
+// and an acquire after it.  OpenCL 1.x has no device scope fence, mem_fence is the closest it has
+#if defined(__OPENCL_C_VERSION__) && __OPENCL_C_VERSION__ >= 200
+	#define device_fence() atomic_work_item_fence(CLK_GLOBAL_MEM_FENCE, memory_order_acq_rel, memory_scope_device)
 #else
-	#define LSIZE 256
+	#define device_fence() mem_fence(CLK_GLOBAL_MEM_FENCE)
+#endif
+
+// subgroup shuffles for reductions, the host defines one of these from the device's extensions
+// SG_INTEL cl_intel_subgroups, SG_KHR cl_khr_subgroup_shuffle, SG_NV warp shuffle with inline PTX
+#if defined(SG_INTEL)
+	#pragma OPENCL EXTENSION cl_intel_subgroups : enable
+	#define SG_SIZE get_sub_group_size()
+	#define SG_ID get_sub_group_id()
+	#define SG_LANE get_sub_group_local_id()
+	#define sg_shuffle_xor(_X, _M) as_ulong( intel_sub_group_shuffle_xor( as_uint2(_X), _M ) )
+#elif defined(SG_KHR)
+	#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+	#pragma OPENCL EXTENSION cl_khr_subgroup_shuffle : enable
+	#define SG_SIZE get_sub_group_size()
+	#define SG_ID get_sub_group_id()
+	#define SG_LANE get_sub_group_local_id()
+	#define sg_shuffle_xor(_X, _M) sub_group_shuffle_xor( _X, _M )
+#elif defined(SG_NV)
+	#define SG_SIZE 32
+	#define SG_ID (get_local_id(0) >> 5)
+	#define SG_LANE (get_local_id(0) & 31)
+	uint shfl_xor(const uint x, const uint m)
+	{
+		uint r;
+		asm volatile ("shfl.sync.bfly.b32 %0, %1, %2, 0x1f, 0xffffffff;" : "=r"(r) : "r"(x), "r"(m));
+		return r;
+	}
+	#define sg_shuffle_xor(_X, _M) upsample( shfl_xor( (uint)((_X) >> 32), _M ), shfl_xor( (uint)(_X), _M ) )
 #endif
 
 // r0 + 2^64 * r1 = (a0 + 2^64 * a1) + (b0 + 2^64 * b1)
@@ -259,6 +297,116 @@ ulong2 m2p_get(const ulong2 x, const ulong p, const ulong q)
 	return (ulong2)(z0, z1);
 }
 
+#ifdef SG_SIZE
+// product of v across a subgroup with butterfly shuffles, every lane gets the result
+ulong2 sg_product(ulong2 v, const ulong p, const ulong q)
+{
+	for(uint m = SG_SIZE>>1; m > 0; m >>= 1){
+		const ulong2 o = (ulong2)( sg_shuffle_xor(v.s0, m), sg_shuffle_xor(v.s1, m) );
+		v = m2p_mul(v, o, p, q);
+	}
+	return v;
+}
+#endif
+
+// product of each work item's v over a workgroup of lsize, the result is valid in work item 0
+// total is local scratch of lsize entries, it can be reused after the call
+// with subgroups there is one local memory step across subgroups instead of a barrier per tree level
+ulong2 group_product(__local ulong2 *total, ulong2 v, const uint lsize, const ulong p, const ulong q, const ulong2 one)
+{
+	const uint lid = get_local_id(0);
+
+#ifdef SG_SIZE
+	v = sg_product(v, p, q);
+
+	if(SG_LANE == 0){
+		total[SG_ID] = v;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	const uint sgsize = SG_SIZE;
+	const uint sgcount = lsize / sgsize;
+
+	if(lid < sgsize){
+		v = (lid < sgcount) ? total[lid] : one;
+		for(uint j = lid + sgsize; j < sgcount; j += sgsize){
+			v = m2p_mul(v, total[j], p, q);
+		}
+		v = sg_product(v, p, q);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return v;
+#else
+	total[lid] = v;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(uint s = lsize>>1; s > 0; s >>= 1){
+		if(lid < s){
+			total[lid] = m2p_mul(total[lid], total[lid+s], p, q);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	return total[0];
+#endif
+}
+
+// called by every thread of a 256 thread mul workgroup with its thread total
+// group totals are kept per batch slot, the last group to take a ticket folds them into the test prime's residue
+// group is the index of this group's part of the slot's primes, there are groups parts
+void fold_groups(	__local ulong2 *total,
+			__local uint *islast,
+			const ulong2 thread_product,
+			const uint group,
+			const uint groups,
+			__global ulong2 *g_grptotal,
+			__global uint *g_ticket,
+			__global ulong2 *g_residues,
+			const uint slot,
+			const uint tpnum,
+			const ulong p,
+			const ulong q,
+			const ulong2 one )
+{
+	const uint lid = get_local_id(0);
+	__global ulong2 *grptotal = g_grptotal + slot * groups;
+
+	const ulong2 product = group_product(total, thread_product, 256, p, q, one);
+
+	if(lid == 0){
+		grptotal[group] = product;
+		// group total must be visible before the ticket is taken
+		device_fence();
+		*islast = (atomic_inc(&g_ticket[slot]) == groups-1) ? 1 : 0;
+		// the other groups' totals are read after their tickets
+		device_fence();
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+	if(*islast){
+		device_fence();
+		// bypass cache, other groups wrote these
+		volatile __global ulong2 *vtotal = grptotal;
+		ulong2 thread_total = (lid < groups) ? vtotal[lid] : one;
+
+		for(uint j=lid+256; j<groups; j+=256){
+			thread_total = m2p_mul( thread_total, vtotal[j], p, q );
+		}
+
+		thread_total = group_product(total, thread_total, 256, p, q, one);
+
+		if(lid == 0){
+			g_residues[tpnum] = m2p_mul( g_residues[tpnum], thread_total, p, q );
+			// reset for the next launch using this slot
+			atomic_xchg(&g_ticket[slot], 0);
+		}
+	}
+}
 
 
 
@@ -17,15 +17,29 @@
 	2) Using constant bit sieve arrays the numbers divisible by the small primes from 7 to 113 are removed.
 	   A set bit in the array represents a multiple of the prime.  Each thread's mod 30 wheel starting number
 	   is modulo the small prime to obtain the correct array index that will tell which of the next 32 odd numbers
-	   are divisible by the prime. Since it's a mod 30 wheel only 30 of the positions are used.  The resulting uints
+	   are divisible by the prime.  The host passes the segment's starting residues in lowres, so a thread only
+	   needs 32 bit modulo of its global id. Since it's a mod 30 wheel only 30 of the positions are used.  The resulting uints
 	   are bitwise ORed.  The unset bits in the uint represent numbers that aren't divisible by any of the primes from 7 to 113.
+	   The workgroup then sieves its range by the primes from 127 to the host's SIEVEBOUND in local memory, the
+	   primes are generated by the host and SIEVECOUNT is set as a build option.  These primes hit each thread's
+	   range at most once, so a shared bitmap is cheaper than a mask table per prime.
 
-	3) Each thread iterates through it's bitsieve unit using the mod 30 wheel index increment.  If a bit is
-	   not set, the number is stored to local memory using a local memory atomic counter.
+	3) Each thread iterates through it's bitsieve unit using the mod 30 wheel index increment.  The unset bits
+	   are collected in a candidate mask.  A workgroup prefix sum of the candidate counts gives each thread the
+	   position of its numbers in local memory.  A workgroup with more than CANDIDATES numbers packs and tests them
+	   in rounds, so there is no local memory overflow.
 
 	4) Packing the numbers in local memory allows all threads to stay busy in the next step, which is performing
-	   a base 2 PRP test.  If the number passes the test, it is stored in global memory with an atomic counter along
-	   with other constant data that will be used in other kernels.
+	   a base 2 PRP test.  A second prefix sum over the passing numbers gives their output positions, one global
+	   atomic per round reserves space for the workgroup.  Only the numbers are stored in global memory, mullarge
+	   computes each prp's power from the type target.  When the host's planner sets offsets, a prp is stored
+	   as the uint (p - low) / 2, half the memory and mullarge reads.  Otherwise it is stored as a ulong.
+
+	getsmprimes generates the exact primes below 2^32 with the same sieve.  Candidates that are strong probable
+	primes to bases 2 and 3 are prime unless they are one of the 104 composites in spsp23.  The primes below the
+	sieve limit are added by the first work item.  The powers of these primes include the higher prime powers, so
+	they are stored for each type.  Each workgroup stores its primes as one block so neighbouring entries usually
+	have the same power, which mulsmall uses to multiply two primes at once.
 	
 */
 
@@ -34,42 +48,18 @@
 #define __ctzl(_X) \
 	63u - clz(_X & -_X)
 
-// r0 + 2^64 * r1 = a * b
-ulong2 mul_wide(const ulong a, const ulong b)
-{
-	ulong2 r;
-
-#ifdef __NV_CL_C_VERSION
-	const uint a0 = (uint)(a), a1 = (uint)(a >> 32);
-	const uint b0 = (uint)(b), b1 = (uint)(b >> 32);
-
-	uint c0 = a0 * b0, c1 = mul_hi(a0, b0), c2, c3;
-
-	asm volatile ("mad.lo.cc.u32 %0, %1, %2, %3;" : "=r" (c1) : "r" (a0), "r" (b1), "r" (c1));
-	asm volatile ("madc.hi.u32 %0, %1, %2, 0;" : "=r" (c2) : "r" (a0), "r" (b1));
-
-	asm volatile ("mad.lo.cc.u32 %0, %1, %2, %3;" : "=r" (c2) : "r" (a1), "r" (b1), "r" (c2));
-	asm volatile ("madc.hi.u32 %0, %1, %2, 0;" : "=r" (c3) : "r" (a1), "r" (b1));
+// count trailing zeros uint
+#define __ctz(_X) \
+	31u - clz(_X & -_X)
 
-	asm volatile ("mad.lo.cc.u32 %0, %1, %2, %3;" : "=r" (c1) : "r" (a1), "r" (b0), "r" (c1));
-	asm volatile ("madc.hi.cc.u32 %0, %1, %2, %3;" : "=r" (c2) : "r" (a1), "r" (b0), "r" (c2));
-	asm volatile ("addc.u32 %0, %1, 0;" : "=r" (c3) : "r" (c3));
+// thread's first number mod q, byte k of v is low mod q from the host
+#define RES(v, k, q) \
+	( ( (((v) >> (8*(k))) & 0xFF) + (gid % (q)) * 60 ) % (q) )
 
-	r.s0 = upsample(c1, c0); r.s1 = upsample(c3, c2);
-#else
-	r.s0 = a * b; r.s1 = mul_hi(a, b);
-#endif
+// numbers packed in local memory per round
+#define CANDIDATES 2048
 
-	return r;
-}
-
-
-ulong invert(ulong p)
-{
-	ulong p_inv = 1, prev = 0;
-	while (p_inv != prev) { prev = p_inv; p_inv *= 2 - p * p_inv; }
-	return p_inv;
-}
+// mul_wide and invert are in common.cl
 
 
 ulong m_mul(ulong a, ulong b, ulong p, ulong q)
@@ -147,6 +137,67 @@ bool strong_prp_two(ulong p)
 }
 
 
+// exclusive prefix sum over the 256 work items of a group, the group total is stored in total
+uint group_scan(const uint v, __local uint * scan, __local uint * total)
+{
+	const uint lid = get_local_id(0);
+
+	scan[lid] = v;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for(uint off = 1; off < 256; off <<= 1){
+		uint t = (lid >= off) ? scan[lid - off] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scan[lid] += t;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	const uint inclusive = scan[lid];
+	if(lid == 255){
+		*total = inclusive;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return inclusive - v;
+}
+
+
+// sieve the 256 * 60 numbers of the workgroup by the primes in g_sieveprime, bits has 241 uints
+// returns the thread's mask in the bitsieve layout, a set bit is a multiple of a sieve prime
+uint local_sieve(const ulong low, __global const uint * g_sieveprime, __local uint * bits)
+{
+	const uint lid = get_local_id(0);
+	const ulong gbase = low + (ulong)get_group_id(0) * 15360;
+
+	if(lid < 241){
+		bits[lid] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// bit j is the number gbase + 2j
+	for(uint i = lid; i < SIEVECOUNT; i += 256){
+		const uint q = g_sieveprime[i];
+		const uint r = gbase % q;
+		uint j = (r == 0) ? 0 : ( (r & 1) ? (q - r) >> 1 : q - (r >> 1) );
+
+		// keep the sieve prime itself
+		if(gbase + 2*j == q){
+			j += q;
+		}
+
+		for(; j < 7680; j += q){
+			atomic_or(&bits[j >> 5], 1u << (j & 31));
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	const uint bit = lid * 30;
+	const ulong two = (ulong)bits[bit >> 5] | ((ulong)bits[(bit >> 5) + 1] << 32);
+
+	return (uint)(two >> (bit & 31)) & 0x3FFFFFFF;
+}
+
+
 // 3 * wheel mod 30
 // this way we don't have to check for index wrap around
 __constant int wheel[24] = {2, 1, 2, 1, 2, 3, 1, 3, 2, 1, 2, 1, 2, 3, 1, 3, 2, 1, 2, 1, 2, 3, 1, 3};
@@ -209,25 +260,22 @@ __constant uint p113[113] = { 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 
 
 __kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void getsegprps(ulong low, ulong high, int wheelidx,
-								__global ulong *g_prime, __global uint *g_primecount,
-								__global uint2 *g_power0, __global uint2 *g_power1, __global uint2 *g_power2,
-								const ulong target0, const ulong target1, const ulong target2,
-								const ulong limit0, const ulong limit1, const ulong limit2
+								__global uint *g_prime, __global uint *g_primecount,
+								__global const uint *g_sieveprime, const uint8 lowres, const uint offsets
  ){
 
 	const uint gid = get_global_id(0);
 	const uint lid = get_local_id(0);
 	int idx = wheelidx;
-	__local ulong sieved[1900];
-	__local int count;
-
-	if(lid == 0){
-		count = 0;
-	}
-	barrier(CLK_LOCAL_MEM_FENCE);
+	__local ulong sieved[CANDIDATES];
+	__local uint bits[241];
+	__local uint scan[256];
+	__local uint total;
+	__local uint base;
 
 	// each thread is 2 turns of the mod 30 wheel
-	ulong P = low + (gid * 60);
+	const ulong P0 = low + ((ulong)gid * 60);
+	ulong P = P0;
 
 	ulong end = P + 60;
 
@@ -236,62 +284,306 @@ __kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void getsegprps(ulong
 	}
 
 	// sieve small primes to 113, this seems optimal
-	uint bitsieve = p7[P%7] | p11[P%11] | p13[P%13] | p17[P%17] | p19[P%19] | p23[P%23] | p29[P%29] | p31[P%31]
-			| p37[P%37] | p41[P%41] | p43[P%43] | p47[P%47] | p53[P%53] | p59[P%59] | p61[P%61] | p67[P%67]
-			| p71[P%71] | p73[P%73] | p79[P%79] | p83[P%83] | p89[P%89] | p97[P%97] | p101[P%101]
-			| p103[P%103] | p107[P%107] | p109[P%109] | p113[P%113];
-
+	// P mod q from the host's low mod q, only 32 bit modulo by constants
+	uint bitsieve = p7[RES(lowres.s0, 0, 7)] | p11[RES(lowres.s0, 1, 11)] | p13[RES(lowres.s0, 2, 13)] | p17[RES(lowres.s0, 3, 17)]
+			| p19[RES(lowres.s1, 0, 19)] | p23[RES(lowres.s1, 1, 23)] | p29[RES(lowres.s1, 2, 29)] | p31[RES(lowres.s1, 3, 31)]
+			| p37[RES(lowres.s2, 0, 37)] | p41[RES(lowres.s2, 1, 41)] | p43[RES(lowres.s2, 2, 43)] | p47[RES(lowres.s2, 3, 47)]
+			| p53[RES(lowres.s3, 0, 53)] | p59[RES(lowres.s3, 1, 59)] | p61[RES(lowres.s3, 2, 61)] | p67[RES(lowres.s3, 3, 67)]
+			| p71[RES(lowres.s4, 0, 71)] | p73[RES(lowres.s4, 1, 73)] | p79[RES(lowres.s4, 2, 79)] | p83[RES(lowres.s4, 3, 83)]
+			| p89[RES(lowres.s5, 0, 89)] | p97[RES(lowres.s5, 1, 97)] | p101[RES(lowres.s5, 2, 101)] | p103[RES(lowres.s5, 3, 103)]
+			| p107[RES(lowres.s6, 0, 107)] | p109[RES(lowres.s6, 1, 109)] | p113[RES(lowres.s6, 2, 113)];
+
+	bitsieve |= local_sieve(low, g_sieveprime, bits);
+
+	// bit k is set when P0 + 2k is a candidate
+	uint cand = 0;
 	while(P < end){
 		if( (bitsieve & 1) == 0 ){
-			sieved[atomic_inc(&count)] = P;
+			cand |= 1u << (uint)((P - P0) >> 1);
 		}
 
 		int inc = wheel[idx++];
 		P += inc*2;
 		bitsieve >>= inc;
 	}
-	barrier(CLK_LOCAL_MEM_FENCE);
 
-	for(int pos = lid; pos < count; pos += 256){
-		ulong p = sieved[pos];
+	const uint offset = group_scan(popcount(cand), scan, &total);
+	const uint count = total;
 
-		if( strong_prp_two(p) ){
-			uint j = atomic_inc(&g_primecount[0]);
+	for(uint round = 0; round < count; round += CANDIDATES){
 
-			g_prime[j] = p;
+		// pack this round's candidates
+		uint c = cand;
+		for(uint pos = offset; c; ++pos){
+			uint k = __ctz(c);
+			c &= c - 1;
+			if(pos >= round && pos < round + CANDIDATES){
+				sieved[pos - round] = P0 + 2*k;
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		// bit i is set when candidate lid + 256i passed
+		const uint n = min((uint)CANDIDATES, count - round);
+		uint pass = 0;
+		for(uint pos = lid, i = 0; pos < n; pos += 256, ++i){
+			if( strong_prp_two(sieved[pos]) ){
+				pass |= 1u << i;
+			}
+		}
 
-			// store power if it is greater than 1
-			uint power, curBit;
-			if(p <= limit0){
-				curBit = 0x80000000;
-				power = target0 / p;
-				curBit >>= ( clz(power) + 1 );
-				g_power0[j] = (uint2)(power, curBit);
+		uint out = group_scan(popcount(pass), scan, &total);
+		if(lid == 0){
+			base = atomic_add(&g_primecount[0], total);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		for(uint pos = lid; pass; pos += 256, pass >>= 1){
+			if( (pass & 1) == 0 ){
+				continue;
 			}
-			if(p <= limit1){
-				curBit = 0x80000000;
-				power = target1 / p;
-				curBit >>= ( clz(power) + 1 );
-				g_power1[j] = (uint2)(power, curBit);
+			if(offsets){
+				g_prime[base + out] = (uint)((sieved[pos] - low) >> 1);
 			}
-			if(p <= limit2){
-				curBit = 0x80000000;
-				power = target2 / p;
-				curBit >>= ( clz(power) + 1 );
-				g_power2[j] = (uint2)(power, curBit);
+			else{
+				vstore2(as_uint2(sieved[pos]), base + out, g_prime);
 			}
+			++out;
+		}
+		// sieved is rewritten by the next round
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+}
+
+
+// strong probable prime test for 32 bit numbers
+bool strong_prp(ulong p, uint base)
+{
+	ulong q = invert(p);
+	ulong one = (-p) % p;
+	ulong nmo = p - one;
+	int t = __ctzl( (p-1) );
+	ulong exp = p >> t;
+
+	// base in montgomery form
+	ulong b = one;
+	for(uint i = 1; i < base; ++i){
+		b = add(b, one, p);
+	}
+
+	// exp is 1 for 2^t+1
+	ulong curBit = 0;
+	if(exp > 1){
+		curBit = 0x8000000000000000;
+		curBit >>= ( clz(exp) + 1 );
+	}
+
+	ulong a = b;
+
+	while( curBit )
+	{
+		a = m_mul(a,a,p,q);
+
+		if(exp & curBit){
+			a = m_mul(a,b,p,q);
+		}
+
+		curBit >>= 1;
+	}
+
+	if (a == one || a == nmo){
+		return true;
+	}
+
+	for (int s = 1; s < t; ++s){
+
+		a = m_mul(a,a,p,q);
+
+		if(a == nmo){
+	    		return true;
 		}
 	}
 
-	if(lid == 0){
-		// set flag to notify cpu of local memory overflow
-		if(count > 1900){
-			atomic_or(&g_primecount[2], 1);
+	return false;
+}
+
+
+// primes below 127, the bit sieve removes them
+__constant uint sieveprimes[30] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113 };
+
+// composites below 2^32 that are strong probable primes to bases 2 and 3
+__constant uint spsp23[104] = {
+	1373653, 1530787, 1987021, 2284453, 3116107, 5173601, 6787327, 11541307,
+	13694761, 15978007, 16070429, 16879501, 25326001, 27509653, 27664033, 28527049,
+	54029741, 61832377, 66096253, 74927161, 80375707, 101649241, 102690677, 104852881,
+	105919633, 106485121, 117987841, 143168581, 154287451, 161304001, 193949641, 206304961,
+	218642029, 223625851, 247318957, 252853921, 259765747, 275619961, 314184487, 326695141,
+	390612221, 393611653, 489994201, 540654409, 572228929, 579606301, 581618143, 682528687,
+	717653129, 745745461, 787085857, 846961321, 871157233, 927106561, 938376181, 960946321,
+	979363153, 981484561, 1028494429, 1157839381, 1168256953, 1236313501, 1463178817, 1481626513,
+	1518290707, 1521221473, 1538012449, 1638294661, 1854940231, 1856689453, 1860373241, 1909566073,
+	1921309633, 1991063449, 1995830761, 2057835781, 2117555641, 2217879901, 2284660351, 2311558021,
+	2323147201, 2412172153, 2431144801, 2626783921, 2693739751, 2736316301, 2781117721, 2837917633,
+	3028586471, 3056100623, 3215031751, 3299246833, 3344191241, 3407772817, 3513604657, 3697278427,
+	3708905341, 3863326897, 3867183937, 4060942381, 4079665633, 4117447441, 4275011401, 4277526901 };
+
+
+bool is_spsp23(uint n)
+{
+	int lo = 0, hi = 103;
+
+	while(lo <= hi){
+		int mid = (lo + hi) >> 1;
+		uint v = spsp23[mid];
+		if(v == n){
+			return true;
+		}
+		if(v < n){
+			lo = mid + 1;
 		}
+		else{
+			hi = mid - 1;
+		}
+	}
+
+	return false;
+}
+
+
+// exponent of prime p in target!
+ulong factorial_power(ulong p, ulong target)
+{
+	ulong total = 0;
+	ulong q = target / p;
+
+	while(q){
+		total += q;
+		q /= p;
 	}
 
+	return total;
 }
 
 
+__kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void getsmprimes(ulong start, ulong low, ulong high, int wheelidx,
+								__global uint *g_prime, __global uint *g_primecount,
+								__global ulong *g_power0, __global ulong *g_power1, __global ulong *g_power2,
+								const ulong target0, const ulong target1, const ulong target2,
+								__global const uint *g_sieveprime
+ ){
 
+	const uint gid = get_global_id(0);
+	const uint lid = get_local_id(0);
+	int idx = wheelidx;
+	__local uint sieved[CANDIDATES];
+	__local uint bits[241];
+	__local uint scan[256];
+	__local uint total;
+	__local uint base;
+
+	// the first work item adds the sieving primes in the segment
+	if(gid == 0){
+		uint n = 0;
+		for(int i = 0; i < 30; ++i){
+			if(sieveprimes[i] >= start && sieveprimes[i] < high){
+				++n;
+			}
+		}
+		uint j = atomic_add(&g_primecount[0], n);
+		for(int i = 0; i < 30; ++i){
+			uint p = sieveprimes[i];
+			if(p >= start && p < high){
+				g_prime[j] = p;
+				g_power0[j] = (p <= target0) ? factorial_power(p, target0) : 0;
+				g_power1[j] = (p <= target1) ? factorial_power(p, target1) : 0;
+				g_power2[j] = (p <= target2) ? factorial_power(p, target2) : 0;
+				++j;
+			}
+		}
+	}
+
+	// each thread is 2 turns of the mod 30 wheel
+	const ulong P0 = low + ((ulong)gid * 60);
+	ulong P = P0;
+
+	ulong end = P + 60;
+
+	if(end > high){
+		end = high;
+	}
+
+	const uint P32 = (uint)P;
+
+	uint bitsieve = p7[P32%7] | p11[P32%11] | p13[P32%13] | p17[P32%17] | p19[P32%19] | p23[P32%23] | p29[P32%29] | p31[P32%31]
+			| p37[P32%37] | p41[P32%41] | p43[P32%43] | p47[P32%47] | p53[P32%53] | p59[P32%59] | p61[P32%61] | p67[P32%67]
+			| p71[P32%71] | p73[P32%73] | p79[P32%79] | p83[P32%83] | p89[P32%89] | p97[P32%97] | p101[P32%101]
+			| p103[P32%103] | p107[P32%107] | p109[P32%109] | p113[P32%113];
+
+	bitsieve |= local_sieve(low, g_sieveprime, bits);
+
+	// bit k is set when P0 + 2k is a candidate
+	uint cand = 0;
+	while(P < end){
+		if( (bitsieve & 1) == 0 && P > 113 ){
+			cand |= 1u << (uint)((P - P0) >> 1);
+		}
+
+		int inc = wheel[idx++];
+		P += inc*2;
+		bitsieve >>= inc;
+	}
+
+	const uint offset = group_scan(popcount(cand), scan, &total);
+	const uint count = total;
+
+	for(uint round = 0; round < count; round += CANDIDATES){
+
+		// pack this round's candidates
+		uint c = cand;
+		for(uint pos = offset; c; ++pos){
+			uint k = __ctz(c);
+			c &= c - 1;
+			if(pos >= round && pos < round + CANDIDATES){
+				sieved[pos - round] = P32 + 2*k;
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		// bit i is set when candidate lid + 256i is prime
+		const uint n = min((uint)CANDIDATES, count - round);
+		uint pass = 0;
+		for(uint pos = lid, i = 0; pos < n; pos += 256, ++i){
+			uint p = sieved[pos];
+			if( strong_prp(p, 2) && strong_prp(p, 3) && !is_spsp23(p) ){
+				pass |= 1u << i;
+			}
+		}
+
+		// one global atomic per round, the workgroup's primes are one block
+		uint out = group_scan(popcount(pass), scan, &total);
+		if(lid == 0){
+			base = atomic_add(&g_primecount[0], total);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		for(uint pos = lid; pass; pos += 256, pass >>= 1){
+			if( (pass & 1) == 0 ){
+				continue;
+			}
+			uint p = sieved[pos];
+			uint j = base + out++;
+
+			g_prime[j] = p;
+
+			// power 0 when the prime is above the type's target
+			g_power0[j] = (p <= target0) ? factorial_power(p, target0) : 0;
+			g_power1[j] = (p <= target1) ? factorial_power(p, target1) : 0;
+			g_power2[j] = (p <= target2) ? factorial_power(p, target2) : 0;
+		}
+		// sieved is rewritten by the next round
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+}
 
@@ -5,58 +5,98 @@
 
 	iterate from type target to each test prime's target factorial
 
+	the host splits each test prime's range (type target, prime target] into chunks of about equal size,
+	one chunk for each workgroup.  a test prime with an empty range still has one empty chunk.
+	the last workgroup to finish a test prime's chunks multiplies the chunk totals into its residue and
+	converts it from montgomery form
+
 */
 
 
 __kernel __attribute__ ((reqd_work_group_size(LSIZE, 1, 1))) void iterate(
-			__global ulong8 *g_tpdata,
-			__global ulong2 *g_tpdataext,
+			__global ulong2 *g_tppq,
+			__global ulong4 *g_tpconst,
+			__global ulong2 *g_residues,
+			__global ulong2 *g_chunk,
+			__global uint *g_chunktp,
+			__global uint2 *g_tpchunks,
+			__global ulong2 *g_chunktotal,
+			__global uint *g_chunkticket,
 			const uint start,
 			const uint stop ){
 
 	const uint lid = get_local_id(0);				
-	const uint group = get_group_id(0);
+	const uint c = start + get_group_id(0);
 	__local ulong2 total[LSIZE];	
-	const uint i = start + group;
+	__local ulong4 tpconst;
+	__local ulong2 range;
+	__local uint islast;
 	
-	// one testprime for each workgroup
-	if(i < stop){
+	// one chunk for each workgroup
+	if(c < stop){
+
+		const uint i = g_chunktp[c];
 
-		// s0=p s1=q s2=one.s0 s3=one.s1 s4=r2.s0 s5=r2.s1 s6=target factorial for this type s7=target factorial for this prime
-		const ulong8 tp = g_tpdata[i];
+		// p and q are read by every work item, the other constants once per workgroup
+		const ulong2 pq = g_tppq[i];
+		const ulong p = pq.s0;
+		const ulong q = pq.s1;
+		if(lid == 0){
+			tpconst = g_tpconst[i];
+			range = g_chunk[c];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		const ulong2 one = tpconst.s01;
+		const ulong2 r2 = tpconst.s23;
+		const ulong last = range.s1;	// s0=first number of the chunk s1=last number of the chunk
 
-		total[lid] = (ulong2)(tp.s2, tp.s3);							// set to 1
+		ulong2 thread_total = one;
 		bool first_iteration = true;
-		ulong currN = tp.s6+1+lid;
-		ulong2 McurrN = m2p_mul_r2( currN, (ulong2)(tp.s4, tp.s5), tp.s0, tp.s1);		// convert currN to montgomery form
-		const ulong2 MLSIZE = m2p_mul_r2( LSIZE, (ulong2)(tp.s4, tp.s5), tp.s0, tp.s1);	// convert LSIZE to montgomery form
+		ulong currN = range.s0+lid;
+		ulong2 McurrN = m2p_mul_r2( currN, r2, p, q);		// convert currN to montgomery form
+		const ulong2 MLSIZE = m2p_mul_r2( LSIZE, r2, p, q);	// convert LSIZE to montgomery form
 		
-		for(; currN <= tp.s7; currN += LSIZE){						// iterate from type target to prime target
+		for(; currN <= last; currN += LSIZE){
 			if(first_iteration){
 				first_iteration = false;
-				total[lid] = McurrN;
+				thread_total = McurrN;
 			}
 			else{
-				total[lid] = m2p_mul( McurrN, total[lid], tp.s0, tp.s1);			
+				thread_total = m2p_mul( McurrN, thread_total, p, q);			
 			}
-			McurrN = m2p_add( McurrN, MLSIZE, tp.s0 );					// add LSIZE
+			McurrN = m2p_add( McurrN, MLSIZE, p );					// add LSIZE
 		}
 
-		barrier(CLK_LOCAL_MEM_FENCE);
+		thread_total = group_product(total, thread_total, LSIZE, p, q, one);
 
-		for(uint s = LSIZE>>1; s > 0; s >>= 1){
-			if(lid < s){
-				total[lid] = m2p_mul(total[lid], total[lid+s], tp.s0, tp.s1);
-			}
-			barrier(CLK_LOCAL_MEM_FENCE);
-		}
+		const uint2 chunks = g_tpchunks[i];	// s0=first chunk of the test prime s1=number of chunks
 
 		if(lid == 0){
-			total[0] = m2p_mul(total[0], g_tpdataext[i], tp.s0, tp.s1)	;		// continue from last residue
-			total[0] = m2p_get(total[0], tp.s0, tp.s1);					// final residue converted from montgomery form
-			g_tpdataext[i] = total[0];							// store to global
+			g_chunktotal[c] = thread_total;
+			// chunk total must be visible before the ticket is taken
+			device_fence();
+			islast = (atomic_inc(&g_chunkticket[i]) == chunks.s1-1) ? 1 : 0;
+			// the other chunks' totals are read after their tickets
+			device_fence();
 		}
+		barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+		if(islast){
+			device_fence();
+			// bypass cache, other groups wrote these
+			volatile __global ulong2 *vtotal = g_chunktotal + chunks.s0;
+			thread_total = one;
+			for(uint j = lid; j < chunks.s1; j += LSIZE){
+				thread_total = m2p_mul( thread_total, vtotal[j], p, q );
+			}
 
+			thread_total = group_product(total, thread_total, LSIZE, p, q, one);
+
+			if(lid == 0){
+				thread_total = m2p_mul(thread_total, g_residues[i], p, q);		// continue from last residue
+				g_residues[i] = m2p_get(thread_total, p, q);				// final residue converted from montgomery form
+			}
+		}
 
 	}
 
@@ -7,78 +7,216 @@
 	
 	these primes/powers (actually prps) are generated on GPU
 	
-	limit is used to reduce memory access and power calculation when we know power = 1
+	limit is used to skip the power calculation when we know power = 1
+	above 2^32 there are no higher prime powers below target, so the power of a prime is target / prime
+
+	the kernel is persistent, the host launches one per segment with about as many workgroups as the device
+	keeps resident.  it covers every test prime of the types that haven't reached their target, the active
+	types' test prime ranges in g_tpindex are listed in tpfirst and their cumulative counts in tpend
+	each work item is one of chunks parts of the primes for a test prime, workgroups take work items in order
+	from the g_queue counter until the segment is done, so a group that finishes early or has little work,
+	like primes past the type's target, takes another item
+
+	group totals are kept in a ring of slots, test prime t uses slot t % slots.  before using a slot the group
+	waits until the slot's previous test prime is folded, g_slotuse counts the folds of each slot.  the items of
+	that test prime were all taken earlier by running groups, so the wait ends
+	the last workgroup to finish for each test prime multiplies the chunk totals into its residue
+	the last workgroup to leave resets g_queue and g_slotuse for the next launch
+
+	the host picks one of 4 variants per segment.  powers is false when the whole segment is above every active
+	type's limit, so no power is calculated.  bounded is false when the whole segment is at or below every active
+	type's target, so no prime is compared to it.  the flags are compile time constants in each kernel and the unused code is removed
+
+	when offsets is set the prps are uints, (prime - low) / 2 from the segment's low, otherwise ulongs
 
 */
 
 
-__kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void mullarge(
-				__global ulong8 *g_tpdata,
-				__global ulong *g_prime,
+// component k of an active type vector, k is 0 to 2
+#define TYPE_SEL(v, k) \
+	( ((k) == 0) ? (v).s0 : ( ((k) == 1) ? (v).s1 : (v).s2 ) )
+
+
+inline void mullarge_body(
+				__global ulong2 *g_tppq,
+				__global ulong4 *g_tpconst,
+				__global uint *g_tpindex,
+				__global uint *g_prime,
 				__global uint *g_primecount,
-				__global uint2 *g_power,
 				__global ulong2 *g_grptotal,
-				const uint tpnum,
-				const ulong limit,
-				const ulong target )
+				__global uint *g_ticket,
+				__global ulong2 *g_residues,
+				__global uint *g_slotuse,
+				const uint4 tpfirst,
+				const uint4 tpend,
+				const ulong4 limits,
+				const ulong4 targets,
+				const uint chunks,
+				__global uint *g_queue,
+				const ulong low,
+				const uint offsets,
+				const uint slots,
+				__local ulong2 *total,
+				__local uint *islast,
+				__local uint *item,
+				__local ulong4 *tpconst,
+				const bool powers,
+				const bool bounded )
 {
-	const uint gid = get_global_id(0);
 	const uint lid = get_local_id(0);
-	const uint gs = get_global_size(0);
 	const uint pcnt = g_primecount[0];
-	__local ulong2 total[256];
-
-	// s0=p s1=q s2=one.s0 s3=one.s1 s4=r2.s0 s5=r2.s1 s6=target factorial for this type s7=target factorial for this prime
-	const ulong8 tp = g_tpdata[tpnum];
-	total[lid] = (ulong2)(tp.s2, tp.s3);		// set to one
-	bool first_iter = true;
-
-	for(uint i = gid; i < pcnt; i+= gs){
-		ulong prime = g_prime[i];
-		uint2 power = (prime > limit) ? (uint2)(1,0) : g_power[i];
-		if(prime <= target){
-			const ulong2 base = m2p_mul_r2( prime, (ulong2)(tp.s4, tp.s5), tp.s0, tp.s1);	// convert prime to montgomery form
-			ulong2 primepow;
-			if(power.s0 == 1){
-				primepow = base;
+	const uint items = tpend.s2 * chunks;
+
+	while(true){
+
+		// one queue atomic per work item, one and r2 are read once per item
+		if(lid == 0){
+			const uint it = atomic_inc(&g_queue[0]);
+			*item = it;
+			if(it < items){
+				const uint t = it / chunks;
+				const uint k = (t >= tpend.s0) + (t >= tpend.s1);
+				const uint pos = TYPE_SEL(tpfirst, k) + t - ((k == 0) ? 0 : ((k == 1) ? tpend.s0 : tpend.s1));
+				*tpconst = g_tpconst[g_tpindex[pos]];
+				// the slot's previous test prime has to be folded before its group totals are replaced
+				while(atomic_add(&g_slotuse[t % slots], 0) != t / slots);
+				device_fence();
 			}
-			else{
-				ulong2 a = base;
-				while( power.s1 ){
-					a = m2p_square(a, tp.s0, tp.s1);
-					if(power.s0 & power.s1){
-						a = m2p_mul(a, base, tp.s0, tp.s1);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+		const uint it = *item;
+		if(it >= items){
+			break;
+		}
+
+		const uint t = it / chunks;
+		const uint chunk = it - t * chunks;
+		const uint slot = t % slots;
+		const uint k = (t >= tpend.s0) + (t >= tpend.s1);
+		const uint tpnum = g_tpindex[TYPE_SEL(tpfirst, k) + t - ((k == 0) ? 0 : ((k == 1) ? tpend.s0 : tpend.s1))];
+		const ulong limit = TYPE_SEL(limits, k);
+		const ulong target = TYPE_SEL(targets, k);
+
+		// p and q are read by every work item
+		const ulong2 pq = g_tppq[tpnum];
+		const ulong p = pq.s0;
+		const ulong q = pq.s1;
+		const ulong2 one = (*tpconst).s01;
+		const ulong2 r2 = (*tpconst).s23;
+
+		ulong2 thread_total = one;
+		bool first_iter = true;
+
+		for(uint i = chunk * 256 + lid; i < pcnt; i += chunks * 256){
+			const ulong prime = offsets ? low + 2*(ulong)g_prime[i] : as_ulong(vload2(i, g_prime));
+			if(!bounded || prime <= target){
+				// s0=power s1=bit below the power's top bit, power is at least 2 at or below limit
+				uint2 power = (uint2)(1,0);
+				if(powers && prime <= limit){
+					power.s0 = (uint)(target / prime);
+					power.s1 = 0x80000000 >> ( clz(power.s0) + 1 );
+				}
+				const ulong2 base = m2p_mul_r2( prime, r2, p, q);	// convert prime to montgomery form
+				ulong2 primepow;
+				if(power.s0 == 1){
+					primepow = base;
+				}
+				else{
+					ulong2 a = base;
+					while( power.s1 ){
+						a = m2p_square(a, p, q);
+						if(power.s0 & power.s1){
+							a = m2p_mul(a, base, p, q);
+						}
+						power.s1 >>= 1;
 					}
-					power.s1 >>= 1;
+					primepow = a;
+				}
+				if(first_iter){
+					first_iter = false;
+					thread_total = primepow;
+				}
+				else{
+					thread_total = m2p_mul(thread_total, primepow, p, q);
 				}
-				primepow = a;
-			}
-			if(first_iter){
-				first_iter = false;
-				total[lid] = primepow;
-			}
-			else{
-				total[lid] = m2p_mul(total[lid], primepow, tp.s0, tp.s1);
 			}
 		}
-	}
 
-	barrier(CLK_LOCAL_MEM_FENCE);
+		fold_groups(total, islast, thread_total, chunk, chunks, g_grptotal, g_ticket, g_residues, slot, tpnum, p, q, one);
 
-	for(uint s = 128; s > 0; s >>= 1){
-		if(lid < s){
-			total[lid] = m2p_mul(total[lid], total[lid+s], tp.s0, tp.s1);
+		// the slot is free for test prime t + slots once the residue and ticket are written
+		if(lid == 0 && *islast){
+			device_fence();
+			atomic_inc(&g_slotuse[slot]);
 		}
+
+		// item and tpconst are rewritten for the next item
 		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
+	// every group has taken its last item when the exit count is complete
 	if(lid == 0){
-		g_grptotal[get_group_id(0)] = total[0];
+		*item = (atomic_inc(&g_queue[1]) == get_num_groups(0)-1) ? 1 : 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if(*item){
+		for(uint s = lid; s < slots; s += 256){
+			atomic_xchg(&g_slotuse[s], 0);
+		}
+		if(lid == 0){
+			atomic_xchg(&g_queue[0], 0);
+			atomic_xchg(&g_queue[1], 0);
+		}
 	}
 
 }
 
 
+#define MULLARGE_ARGS	__global ulong2 *g_tppq, __global ulong4 *g_tpconst, __global uint *g_tpindex, \
+			__global uint *g_prime, __global uint *g_primecount, \
+			__global ulong2 *g_grptotal, __global uint *g_ticket, __global ulong2 *g_residues, \
+			__global uint *g_slotuse, const uint4 tpfirst, const uint4 tpend, \
+			const ulong4 limits, const ulong4 targets, const uint chunks, __global uint *g_queue, \
+			const ulong low, const uint offsets, const uint slots
+
+#define MULLARGE_CALL	g_tppq, g_tpconst, g_tpindex, g_prime, g_primecount, g_grptotal, g_ticket, \
+			g_residues, g_slotuse, tpfirst, tpend, limits, targets, chunks, g_queue, low, offsets, slots, \
+			total, &islast, &item, &tpconst
 
+// local memory has to be declared in the kernel
+#define MULLARGE_LOCAL	__local ulong2 total[256]; \
+			__local uint islast; \
+			__local uint item; \
+			__local ulong4 tpconst;
 
 
+// segment above limit and at or below target
+__kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void mullarge( MULLARGE_ARGS )
+{
+	MULLARGE_LOCAL
+	mullarge_body( MULLARGE_CALL, false, false );
+}
+
+// segment with primes at or below limit
+__kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void mullarge_pow( MULLARGE_ARGS )
+{
+	MULLARGE_LOCAL
+	mullarge_body( MULLARGE_CALL, true, false );
+}
+
+// segment with primes past target
+__kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void mullarge_bound( MULLARGE_ARGS )
+{
+	MULLARGE_LOCAL
+	mullarge_body( MULLARGE_CALL, false, true );
+}
+
+// segment with both
+__kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void mullarge_pow_bound( MULLARGE_ARGS )
+{
+	MULLARGE_LOCAL
+	mullarge_body( MULLARGE_CALL, true, true );
+}
+
@@ -5,75 +5,98 @@
 	
 	multiply by prime^power for each prime <2^32
 	
-	these primes/powers are generated on CPU and compressed to ulongs
+	these primes and their powers are generated on GPU by getsmprimes
+
+	each work item takes two neighbouring primes, when both have the same power they are multiplied
+	together first.  the product of two 32 bit primes always fits in a ulong.  power 0 is a prime above the type's target
+
+	dimension 1 of the NDRange is a batch of test primes of the same type, indexed through g_tpindex
+
+	the last workgroup to finish for each test prime multiplies the group totals into its residue
 	
 */
 
 
+// prime^power in montgomery form, power > 0
+ulong2 small_power(const ulong prime, const ulong power, const ulong2 r2, const ulong p, const ulong q)
+{
+	const ulong2 base = m2p_mul_r2( prime, r2, p, q);	// convert prime to montgomery form
+
+	if(power == 1){
+		return base;
+	}
+
+	ulong curBit = 0x8000000000000000;
+	curBit >>= ( clz(power) + 1 );
+
+	ulong2 a = base;
+	while( curBit ){
+		a = m2p_square(a, p, q);
+		if(power & curBit){
+			a = m2p_mul(a, base, p, q);
+		}
+		curBit >>= 1;
+	}
+
+	return a;
+}
+
 
 __kernel __attribute__ ((reqd_work_group_size(256, 1, 1))) void mulsmall(
-				__global ulong8 *g_tpdata,
-				__global ulong * g_smallprimes,
-				__global ulong2 * g_smallpowers,
+				__global ulong2 *g_tppq,
+				__global ulong4 *g_tpconst,
+				__global uint *g_tpindex,
+				__global uint *g_prime,
+				__global uint *g_primecount,
+				__global ulong *g_power,
 				__global ulong2 *g_grptotal,
-				const uint tpnum,
-				const uint pcnt )
+				__global uint *g_ticket,
+				__global ulong2 *g_residues,
+				const uint tpstart )
 {
 	const uint gid = get_global_id(0);
-	const uint lid = get_local_id(0);
 	const uint gs = get_global_size(0);
+	const uint pcnt = g_primecount[0];
+	const uint pairs = (pcnt + 1) >> 1;
+	const uint slot = get_global_id(1);
+	const uint tpnum = g_tpindex[tpstart + slot];
 	__local ulong2 total[256];
+	__local uint islast;
+	__local ulong4 tpconst;
 
-	// s0=p s1=q s2=one.s0 s3=one.s1 s4=r2.s0 s5=r2.s1 s6=residue.s0 s7=residue.s1
-	const ulong8 tp = g_tpdata[tpnum];
-	total[lid] = (ulong2)(tp.s2, tp.s3);		// set to one
-	bool first_iter = true;	
-
-	for(uint i = gid; i < pcnt; i+= gs){
-		ulong prime = g_smallprimes[i];
-		// .s0=exp, .s1=curBit
-		ulong2 power = g_smallpowers[i];
-		const ulong2 base = m2p_mul_r2( prime, (ulong2)(tp.s4, tp.s5), tp.s0, tp.s1);	// convert prime to montgomery form
-		ulong2 primepow;
-		if(power.s0 == 1){
-			primepow = base;
-		}
-		else{
-			ulong2 a = base;
-			while( power.s1 ){
-				a = m2p_square(a, tp.s0, tp.s1);
-				if(power.s0 & power.s1){
-					a = m2p_mul(a, base, tp.s0, tp.s1);
-				}
-				power.s1 >>= 1;
-			}
-			primepow = a;
-		}
-		if(first_iter){
-			first_iter = false;
-			total[lid] = primepow;
-		}
-		else{
-			total[lid] = m2p_mul(total[lid], primepow, tp.s0, tp.s1);
-		}		
+	// p and q are read by every work item, one and r2 once per workgroup
+	const ulong2 pq = g_tppq[tpnum];
+	const ulong p = pq.s0;
+	const ulong q = pq.s1;
+	if(get_local_id(0) == 0){
+		tpconst = g_tpconst[tpnum];
 	}
-
 	barrier(CLK_LOCAL_MEM_FENCE);
+	const ulong2 one = tpconst.s01;
+	const ulong2 r2 = tpconst.s23;
 
-	for(uint s = 128; s > 0; s >>= 1){
-		if(lid < s){
-			total[lid] = m2p_mul(total[lid], total[lid+s], tp.s0, tp.s1);
+	ulong2 thread_total = one;
+
+	for(uint i = gid; i < pairs; i+= gs){
+		const uint k = i << 1;
+		ulong prime = g_prime[k];
+		ulong power = g_power[k];
+		if(k + 1 < pcnt){
+			const ulong prime1 = g_prime[k+1];
+			const ulong power1 = g_power[k+1];
+			if(power1 == power){
+				prime *= prime1;
+			}
+			else if(power1){
+				thread_total = m2p_mul(thread_total, small_power(prime1, power1, r2, p, q), p, q);
+			}
+		}
+		if(power){
+			thread_total = m2p_mul(thread_total, small_power(prime, power, r2, p, q), p, q);
 		}
-		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
-	if(lid == 0){
-		g_grptotal[get_group_id(0)] = total[0];
-	}
+	fold_groups(total, &islast, thread_total, get_group_id(0), get_num_groups(0), g_grptotal, g_ticket, g_residues, slot, tpnum, p, q, one);
 
 }
 
-
-
-
-
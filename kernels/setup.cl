@@ -8,9 +8,8 @@
 */
 
 
-__kernel void setup(__global ulong *g_testprime, __global ulong8 *g_tpdata,
-			const uint tpcount, const ulong tar0, const ulong tar1, const ulong tar2,
-			__global ulong2 *g_residues, const uint resume){
+__kernel void setup(__global ulong *g_testprime, __global ulong2 *g_tppq, __global ulong4 *g_tpconst,
+			const uint tpcount, __global ulong2 *g_residues, const uint resume){
 
 	const uint gid = get_global_id(0);
 	const uint gs = get_global_size(0);
@@ -28,21 +27,9 @@ __kernel void setup(__global ulong *g_testprime, __global ulong8 *g_tpdata,
 		r2 = m2p_square(r2, p, q);
 		r2 = m2p_square(r2, p, q);	// 4^{2^5} = 2^64
 
-		ulong targettype, targetprime;
-		if(p % 3 == 1){
-			targettype = tar0;
-			targetprime = (p-1)/6;
-		}
-		else if(p % 12 == 5){
-			targettype = tar1;
-			targetprime = (p-1)/4;
-		}
-		else if(p % 12 == 11){
-			targettype = tar2;
-			targetprime = (p-1)/2;
-		}
-		// s0=p s1=q s2=one.s0 s3=one.s1 s4=r2.s0 s5=r2.s1 s6=target factorial for this type s7=target factorial for this prime
-		g_tpdata[position] = (ulong8)( p, q, one.s0, one.s1, r2.s0, r2.s1, targettype, targetprime );
+		// hot constants used by every work item, cold constants are read once per workgroup
+		g_tppq[position] = (ulong2)( p, q );
+		g_tpconst[position] = (ulong4)( one.s0, one.s1, r2.s0, r2.s1 );
 
 		if(!resume){
 			g_residues[position] = (ulong2)( one.s0, one.s1 );
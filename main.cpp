@@ -34,12 +34,13 @@ void help()
 	printf("-s 	Perform self test to verify proper operation of the program with the current GPU.\n");
 	printf("-r 	Verify all results (up to 2e13) where |w_p/p| < 1/50000 with known good file %s\n",GOOD_RES_FILENAME);
 	printf("	-s and -r are for use in standalone testing.\n");
+	printf("-t 	Tune kernel launch parameters for the current GPU and save them to %s\n",TUNE_FILENAME);
 	printf("-h	Print this help\n");
         boinc_finish(EXIT_FAILURE);
 }
 
 
-static const char *short_opts = "p:P:srd:h";
+static const char *short_opts = "p:P:srtd:h";
 
 static int parse_option(int opt, char *arg, const char *source, workStatus *st, searchData *sd)
 {
@@ -61,6 +62,12 @@ static int parse_option(int opt, char *arg, const char *source, workStatus *st,
       printf("Performing self test.\n");
       break;
 
+    case 't':
+      sd->tune = true;
+      fprintf(stderr,"Tuning kernel launch parameters.\n");
+      printf("Tuning kernel launch parameters.\n");
+      break;
+
     case 'd':
       break;
       
@@ -85,6 +92,7 @@ static int parse_option(int opt, char *arg, const char *source, workStatus *st,
 static const struct option long_opts[] = {
   {"device",  optional_argument, 0, 'd'},		// handle --device arg, but it's not used
   {"test",  no_argument, 0, 's'},
+  {"tune",  no_argument, 0, 't'},
   {0,0,0,0}
 };
 
@@ -187,6 +195,19 @@ int main(int argc, char *argv[])
 
 	process_args(argc,argv,&st,&sd);
 
+	// compiled kernel binaries and the tuning file are kept in the BOINC project directory, or the working directory when standalone
+	char tune_file[1024];
+	if(boinc_is_standalone()){
+		sclSetBinaryCache(".");
+		snprintf(tune_file, sizeof(tune_file), "%s", TUNE_FILENAME);
+	}
+	else{
+		APP_INIT_DATA init_data;
+		boinc_get_init_data(init_data);
+		sclSetBinaryCache(init_data.project_dir);
+		snprintf(tune_file, sizeof(tune_file), "%s/%s", init_data.project_dir, TUNE_FILENAME);
+	}
+
 	primesieve_set_num_threads(1);
 
 	cl_platform_id platform = 0;
@@ -287,36 +308,25 @@ int main(int argc, char *argv[])
 		printf("GPU Info:\n  Name: \t\t%s\n  Vendor: \t\t%s\n  Driver: \t\t%s\n  Compute Units: \t%u\n", device_name, device_vend, device_driver, CUs);
 	}
 
-	// check vendor and normalize compute units
-	// kernel size will be determined by profiling so this doesn't have to be accurate.
-	sd.computeunits = CUs;
-	char intel_s[] = "Intel";
-	char arc_s[] = "Arc";
+	// the reported compute units are the first guess of the prp kernel range, profiling corrects it
+	// and they size the persistent mullarge launch
+	sd.computeunits = (CUs) ? CUs : 1;
 	char nvidia_s[] = "NVIDIA";	
 
 	if(strstr((char*)device_vend, (char*)nvidia_s) != NULL){
 		sd.nvidia = true;
 	}
-	// Intel
-	else if( strstr((char*)device_vend, (char*)intel_s) != NULL ){
-
-		if( strstr((char*)device_name, (char*)arc_s) != NULL ){
-			sd.computeunits /= 10;
-		}
-		else{
-			sd.computeunits /= 20;
-	                fprintf(stderr,"Detected Intel integrated graphics\n");	
-		}
 
+	// launch parameters, replaced by a previous --tune run on this device and driver
+	setDefaultTuning(sd);
+	if(!sd.tune){
+		loadTuning(sd, tune_file, device_name, device_driver);
 	}
-	// AMD
-        else{
-		sd.computeunits /= 2;
-        }
-
-	if(!sd.computeunits) sd.computeunits = 1;
 
-	if(sd.test){
+	if(sd.tune){
+		run_tune(hardware, sd, st, tune_file, device_name, device_driver);
+	}
+	else if(sd.test){
 		run_test(hardware, sd, st);
 	}
 	else{
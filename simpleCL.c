@@ -26,6 +26,7 @@ extern "C" {
 #endif
 
 #include "simpleCL.h"
+#include <unistd.h>
 
 void sclPrintErrorFlags( cl_int flag ){
     
@@ -349,39 +350,54 @@ void sclPrintErrorFlags( cl_int flag ){
 
 
 
-void sclGetBinary( sclSoft software ){
+// write a built program's binary to filename, returns 1 on success
+// written to a temporary file and renamed so another task never loads a partial binary
+int sclGetBinary( cl_program program, const char * filename ){
 
 	size_t size;
 	cl_int err;
+	char tmpname[1100];
 
-	err = clGetProgramInfo( software.program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL );
-	if ( err!=CL_SUCCESS ) {
-		printf( "Error: clGetProgramInfo\n" );
-		fprintf(stderr, "Error: clGetProgramInfo\n" );
-		sclPrintErrorFlags( err );
+	err = clGetProgramInfo( program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL );
+	if ( err!=CL_SUCCESS || size == 0 ) {
+		fprintf(stderr, "Warning: cannot get program binary for %s\n", filename );
+		return 0;
 	}
 
 	unsigned char * binary = new unsigned char [ size ];
 
-	err = clGetProgramInfo( software.program, CL_PROGRAM_BINARIES, size, &binary, NULL );
+	err = clGetProgramInfo( program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binary, NULL );
 	if ( err!=CL_SUCCESS ) {
-		printf( "Error: clGetProgramInfo\n" );
-		fprintf(stderr, "Error: clGetProgramInfo\n" );
-		sclPrintErrorFlags( err );
+		fprintf(stderr, "Warning: cannot get program binary for %s\n", filename );
+		delete [ ] binary;
+		return 0;
 	}
 
-	FILE * fpbin = fopen( software.kernelName, "wb" );
+	snprintf( tmpname, sizeof(tmpname), "%s.%d", filename, (int)getpid() );
+
+	int written = 0;
+	FILE * fpbin = fopen( tmpname, "wb" );
 	if( fpbin == NULL ){
-		printf( "Error: cannot write binary: %s\n", software.kernelName );
-		fprintf( stderr, "Error: cannot write binary: %s\n", software.kernelName );
+		fprintf( stderr, "Warning: cannot write binary: %s\n", tmpname );
 	}
 	else
 	{
-		fwrite( binary, 1, size, fpbin );
-		fclose( fpbin );
+		written = ( fwrite( binary, 1, size, fpbin ) == size );
+		if( fclose( fpbin ) != 0 ) written = 0;
+		if( written ){
+			// rename fails on windows if another task already wrote the file
+			if( rename( tmpname, filename ) != 0 ){
+				remove( tmpname );
+			}
+		}
+		else{
+			remove( tmpname );
+		}
 	}
 	delete [ ] binary;
 
+	return written;
+
 }
 
 
@@ -451,6 +467,116 @@ void _sclBuildProgram( cl_program program, cl_device_id devices, const char* pNa
 
 }
 
+// directory for cached program binaries, empty when disabled
+static char _sclCacheDir[1024] = "";
+
+void sclSetBinaryCache( const char * dir ){
+
+	snprintf( _sclCacheDir, sizeof(_sclCacheDir), "%s", dir );
+
+}
+
+// 64 bit FNV-1a
+static uint64_t _sclHash( uint64_t h, const char * str ){
+
+	for( ; *str; ++str ){
+		h ^= (unsigned char)*str;
+		h *= 0x100000001B3ULL;
+	}
+
+	return h;
+}
+
+// cache file for this device, driver, build options and source
+void _sclCacheFilename( char * filename, size_t len, const char* program_source, sclHard hardware, const char * options )
+{
+	char device_name[1024] = "";
+	char device_driver[1024] = "";
+
+	clGetDeviceInfo( hardware.device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL );
+	clGetDeviceInfo( hardware.device, CL_DRIVER_VERSION, sizeof(device_driver), device_driver, NULL );
+
+	uint64_t h = 0xCBF29CE484222325ULL;
+	h = _sclHash( h, device_name );
+	h = _sclHash( h, "\n" );
+	h = _sclHash( h, device_driver );
+	h = _sclHash( h, "\n" );
+	h = _sclHash( h, (options != NULL) ? options : "" );
+	h = _sclHash( h, "\n" );
+	h = _sclHash( h, program_source );
+
+	snprintf( filename, len, "%s/clwilson_%016llx.bin", _sclCacheDir, (unsigned long long)h );
+}
+
+// load a program binary from the cache, returns NULL if it is missing or does not build
+cl_program _sclLoadBinary( const char * filename, sclHard hardware, const char * options )
+{
+	FILE * fpbin = fopen( filename, "rb" );
+	if( fpbin == NULL ){
+		return NULL;
+	}
+
+	fseek( fpbin, 0, SEEK_END );
+	long fsize = ftell( fpbin );
+	fseek( fpbin, 0, SEEK_SET );
+	if( fsize <= 0 ){
+		fclose( fpbin );
+		return NULL;
+	}
+
+	size_t size = (size_t)fsize;
+	unsigned char * binary = new unsigned char [ size ];
+	size_t x = fread( binary, 1, size, fpbin );
+	fclose( fpbin );
+	if( x != size ){
+		delete [ ] binary;
+		return NULL;
+	}
+
+	cl_int err, status;
+	const unsigned char * bin = binary;
+	cl_program program = clCreateProgramWithBinary( hardware.context, 1, &hardware.device, &size, &bin, &status, &err );
+	delete [ ] binary;
+
+	if( err != CL_SUCCESS || status != CL_SUCCESS ){
+		if( program != NULL ) clReleaseProgram( program );
+		return NULL;
+	}
+
+	// a binary still has to be built, this fails if the driver rejects it
+	err = clBuildProgram( program, 0, NULL, options, NULL, NULL );
+	if( err != CL_SUCCESS ){
+		clReleaseProgram( program );
+		return NULL;
+	}
+
+	return program;
+}
+
+// create and build a program, using the binary cache when enabled
+cl_program _sclCreateAndBuildProgram( const char* program_source, sclHard hardware, const char* pName, const char * options )
+{
+	char filename[1100];
+	cl_program program;
+
+	if( _sclCacheDir[0] ){
+		_sclCacheFilename( filename, sizeof(filename), program_source, hardware, options );
+		program = _sclLoadBinary( filename, hardware, options );
+		if( program != NULL ){
+			return program;
+		}
+	}
+
+	program = _sclCreateProgram( program_source, hardware.context );
+	_sclBuildProgram( program, hardware.device, pName, options );
+
+	if( _sclCacheDir[0] ){
+		sclGetBinary( program, filename );
+	}
+
+	return program;
+}
+
 cl_kernel _sclCreateKernel( sclSoft software ) {
 	cl_kernel kernel;
 	cl_int err;
@@ -549,6 +675,24 @@ double ProfilesclEnqueueKernelNS( sclHard hardware, sclSoft software) {
 }
 
 
+// run time of a completed kernel event, -1 if it is not complete or the queue has no profiling
+double sclEventMs( cl_event event ) {
+	cl_int status;
+	cl_ulong time_start;
+	cl_ulong time_end;
+
+	if( clGetEventInfo( event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL ) != CL_SUCCESS || status != CL_COMPLETE ){
+		return -1.0;
+	}
+	if( clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL ) != CL_SUCCESS
+		|| clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL ) != CL_SUCCESS ){
+		return -1.0;
+	}
+
+	return (time_end-time_start) / 1000000.0;
+}
+
+
 
 void sclSetGlobalSize( sclSoft & software, uint64_t size ) {
 
@@ -634,15 +778,10 @@ sclSoft sclGetCLSoftware( const char* source, const char* name, sclHard hardware
 
 	sprintf( software.kernelName, "%s", name);
 	
-	/* Create program objects from source
+	/* Create and build program objects from source or cached binary
 	 ########################################################### */
-	software.program = _sclCreateProgram( source, hardware.context );
+	software.program = _sclCreateAndBuildProgram( source, hardware, name, options );
 	/* ########################################################### */
-	
-	/* Build the program (compile it)
-   	 ############################################ */
-   	_sclBuildProgram( software.program, hardware.device, name, options );
-   	/* ############################################ */
    	
    	/* Create the kernel object
 	 ########################################################################## */
@@ -679,17 +818,12 @@ sclSoft sclGetCLSoftwareWithCommon( const char* common, const char* source, cons
 	strcpy(combined_src, common);
 	strcat(combined_src, source);
 	
-	/* Create program objects from source
+	/* Create and build program objects from source or cached binary
 	 ########################################################### */
-	software.program = _sclCreateProgram( (const char *)combined_src, hardware.context );
+	software.program = _sclCreateAndBuildProgram( (const char *)combined_src, hardware, name, options );
 	/* ########################################################### */
 	
         free(combined_src);	
-	
-	/* Build the program (compile it)
-   	 ############################################ */
-   	_sclBuildProgram( software.program, hardware.device, name, options );
-   	/* ############################################ */
    	
    	/* Create the kernel object
 	 ########################################################################## */
@@ -715,6 +849,58 @@ sclSoft sclGetCLSoftwareWithCommon( const char* common, const char* source, cons
 }
 
 
+// build one program from several sources concatenated in order
+cl_program sclGetCLProgram( const char** sources, int count, sclHard hardware, const char * options ){
+
+	size_t total_len = 1;
+	for(int i=0; i<count; ++i){
+		total_len += strlen(sources[i]);
+	}
+	char *combined_src = (char *)malloc(total_len);
+	combined_src[0] = '\0';
+	for(int i=0; i<count; ++i){
+		strcat(combined_src, sources[i]);
+	}
+
+	cl_program program = _sclCreateAndBuildProgram( (const char *)combined_src, hardware, "combined", options );
+
+	free(combined_src);
+
+	return program;
+
+}
+
+
+// create a kernel from an already built program, the sclSoft holds its own reference to the program
+sclSoft sclGetCLSoftwareFromProgram( cl_program program, const char* name, sclHard hardware ){
+
+	sclSoft software;
+
+	sprintf( software.kernelName, "%s", name);
+
+	clRetainProgram( program );
+	software.program = program;
+
+	software.kernel = _sclCreateKernel( software );
+
+	cl_int err;
+	size_t workgroupsize;
+
+	err = clGetKernelWorkGroupInfo( software.kernel, hardware.device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroupsize, NULL);
+
+	if ( err != CL_SUCCESS ) {
+		printf( "\nError getting kernel workgroup size\n");
+		fprintf(stderr, "Error getting kernel workgroup size\n");
+		sclPrintErrorFlags(err); 
+	}
+
+	software.local_size[0] = workgroupsize;
+
+	return software;
+
+}
+
+
 void sclWrite( sclHard hardware, size_t size, cl_mem buffer, void* hostPointer ) {
 
 	cl_int err;
@@ -741,6 +927,47 @@ void sclWriteNB( sclHard hardware, size_t size, cl_mem buffer, void* hostPointer
 
 }
 
+/* Pinned host memory.  The buffer stays mapped until it is freed, the host pointer can be used
+   with sclRead / sclWrite on other buffers for DMA transfers */
+void* sclAllocPinned( sclHard hardware, size_t size, cl_mem * buffer ) {
+
+	cl_int err;
+
+	*buffer = clCreateBuffer( hardware.context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		printf( "\nclCreateBuffer Error on sclAllocPinned\n" );
+		fprintf(stderr, "\nclCreateBuffer Error on sclAllocPinned\n" );
+		sclPrintErrorFlags( err );
+	}
+
+	void * hostPointer = clEnqueueMapBuffer( hardware.queue, *buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, NULL, NULL, &err );
+	if ( err != CL_SUCCESS ) {
+		printf( "\nclEnqueueMapBuffer Error on sclAllocPinned\n" );
+		fprintf(stderr, "\nclEnqueueMapBuffer Error on sclAllocPinned\n" );
+		sclPrintErrorFlags( err );
+	}
+
+	return hostPointer;
+
+}
+
+void sclFreePinned( sclHard hardware, cl_mem buffer, void * hostPointer ) {
+
+	cl_int err;
+
+	if( buffer != NULL ){
+		err = clEnqueueUnmapMemObject( hardware.queue, buffer, hostPointer, 0, NULL, NULL );
+		if ( err != CL_SUCCESS ) {
+			printf( "\nclEnqueueUnmapMemObject Error on sclFreePinned\n" );
+			fprintf(stderr, "\nclEnqueueUnmapMemObject Error on sclFreePinned\n" );
+			sclPrintErrorFlags( err );
+		}
+		sclFinish( hardware );
+		sclReleaseMemObject( buffer );
+	}
+
+}
+
 void sclRead( sclHard hardware, size_t size, cl_mem buffer, void *hostPointer ) {
 
 	cl_int err;
@@ -783,6 +1010,35 @@ cl_int sclFinish( sclHard hardware ){
 
 }
 
+cl_int sclFlush( sclHard hardware ){
+
+	cl_int err;
+
+	err = clFlush( hardware.queue );
+	if ( err != CL_SUCCESS ) {
+		printf( "\nError clFlush\n" );
+		fprintf(stderr, "\nError clFlush\n" );
+		sclPrintErrorFlags( err );
+	}
+
+	return err;
+
+}
+
+// commands queued after this will not start until event is complete, event can be from another queue
+void sclEnqueueWaitForEvent( sclHard hardware, cl_event event ){
+
+	cl_int err;
+
+	err = clEnqueueWaitForEvents( hardware.queue, 1, &event );
+	if ( err != CL_SUCCESS ) {
+		printf( "\nError clEnqueueWaitForEvents\n" );
+		fprintf(stderr, "\nError clEnqueueWaitForEvents\n" );
+		sclPrintErrorFlags( err );
+	}
+
+}
+
 
 void sclSetKernelArg( sclSoft software, int argnum, size_t typeSize, void *argument ){
 
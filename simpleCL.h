@@ -64,7 +64,8 @@ typedef struct {
 
 /* USER FUNCTIONS */
 
-void sclGetBinary( sclSoft software );
+int sclGetBinary( cl_program program, const char * filename );
+void sclSetBinaryCache( const char * dir );
 void sclSetGlobalSize( sclSoft & software, uint64_t size );
 void sclSetGlobalSizeExact( sclSoft & software, uint64_t size );
 
@@ -75,12 +76,16 @@ void 		sclWrite( sclHard hardware, size_t size, cl_mem buffer, void* hostPointer
 void 		sclWriteNB( sclHard hardware, size_t size, cl_mem buffer, void* hostPointer );
 void		sclReadNB( sclHard hardware, size_t size, cl_mem buffer, void *hostPointer );
 void		sclRead( sclHard hardware, size_t size, cl_mem buffer, void *hostPointer );
+void*		sclAllocPinned( sclHard hardware, size_t size, cl_mem * buffer );
+void		sclFreePinned( sclHard hardware, cl_mem buffer, void * hostPointer );
 
 /* ######################################################## */
 
 /* ####### inicialization of sclSoft structs  ############## */
 sclSoft 	sclGetCLSoftware( const char* source, const char* name, sclHard hardware, const char * options );
 sclSoft 	sclGetCLSoftwareWithCommon( const char* common, const char* source, const char* name, sclHard hardware, const char * options );
+cl_program 	sclGetCLProgram( const char** sources, int count, sclHard hardware, const char * options );
+sclSoft 	sclGetCLSoftwareFromProgram( cl_program program, const char* name, sclHard hardware );
 
 /* ######################################################## */
 
@@ -104,12 +109,15 @@ void		sclEnqueueKernel( sclHard hardware, sclSoft software );
 cl_event	sclEnqueueKernelEvent( sclHard hardware, sclSoft software );
 double		ProfilesclEnqueueKernel( sclHard hardware, sclSoft software );
 double		ProfilesclEnqueueKernelNS( sclHard hardware, sclSoft software );
+double		sclEventMs( cl_event event );
 
 /* ######################################################## */
 
 /* ####### Queue management ############################### */
 
 cl_int		sclFinish( sclHard hardware );
+cl_int		sclFlush( sclHard hardware );
+void		sclEnqueueWaitForEvent( sclHard hardware, cl_event event );
 
 /* ######################################################## */
 
@@ -129,6 +137,9 @@ void 		sclSetKernelArg( sclSoft software, int argnum, size_t typeSize, void *arg
 void 		_sclBuildProgram( cl_program program, cl_device_id devices, const char* pName, const char * options );
 cl_kernel 	_sclCreateKernel( sclSoft software );
 cl_program 	_sclCreateProgram( const char* program_source, cl_context context );
+cl_program 	_sclCreateAndBuildProgram( const char* program_source, sclHard hardware, const char* pName, const char * options );
+cl_program 	_sclLoadBinary( const char * filename, sclHard hardware, const char * options );
+void 		_sclCacheFilename( char * filename, size_t len, const char* program_source, sclHard hardware, const char * options );
 char* 		_sclLoadProgramSource( const char *filename );
 
 /* ######################################################## */